@@ -0,0 +1,1162 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+/*
+ * numbfs inode and block allocation
+ *
+ * The inode table and the data area are split into in-memory allocation
+ * groups, the on-disk format is unchanged.  Each group covers the data
+ * blocks of one block bitmap block and a word-aligned slice of the inode
+ * bitmap, so groups never share bitmap words.  A group has its own lock,
+ * free extent tree and free counters; the global per-CPU free counters
+ * only hand out quota.
+ */
+
+#include "internal.h"
+#include <linux/random.h>
+#include <linux/list_sort.h>
+#include <linux/blkdev.h>
+
+/* copy the in-memory bitmap block covering @bit to the metadata cache */
+static int numbfs_bitmap_dirty(struct super_block *sb,
+			       struct numbfs_bitmap *bm, int bit)
+{
+	int idx = bit / NUMBFS_BLOCKS_PER_BLOCK;
+	struct numbfs_buf buf;
+	int err;
+
+	err = numbfs_binit(&buf, sb->s_bdev, numbfs_bmap_blk(bm->startblk, bit));
+	if (err)
+		return err;
+
+	numbfs_bcopy(&buf, (char*)bm->map + idx * NUMBFS_BYTES_PER_BLOCK);
+	numbfs_bput(&buf);
+	return 0;
+}
+
+/* load @total bits of the on-disk bitmap starting at @startblk */
+int numbfs_bitmap_load(struct super_block *sb, struct numbfs_bitmap *bm,
+		       int startblk, int total)
+{
+	int nblks = DIV_ROUND_UP(total, NUMBFS_BLOCKS_PER_BLOCK);
+	struct numbfs_buf bufs[NUMBFS_BITMAP_BATCH];
+	int i, n, done, err;
+
+	bm->map = kvzalloc(nblks * NUMBFS_BYTES_PER_BLOCK, GFP_KERNEL);
+	if (!bm->map)
+		return -ENOMEM;
+	bm->startblk = startblk;
+	bm->total = total;
+
+	for (done = 0; done < nblks; done += n) {
+		n = min(nblks - done, NUMBFS_BITMAP_BATCH);
+		for (i = 0; i < n; i++) {
+			err = numbfs_binit(&bufs[i], sb->s_bdev,
+					   startblk + done + i);
+			if (err) {
+				/* only put the initialized buffers */
+				n = i;
+				break;
+			}
+		}
+
+		if (!err)
+			err = numbfs_brw_batch(bufs, n, NUMBFS_READ);
+
+		for (i = 0; i < n; i++) {
+			if (!err)
+				memcpy((char*)bm->map +
+				       (done + i) * NUMBFS_BYTES_PER_BLOCK,
+				       bufs[i].base, NUMBFS_BYTES_PER_BLOCK);
+			numbfs_bput(&bufs[i]);
+		}
+
+		if (err) {
+			pr_err("numbfs: failed to load bitmap@%d\n", startblk);
+			numbfs_bitmap_release(bm);
+			return err;
+		}
+	}
+	return 0;
+}
+
+void numbfs_bitmap_release(struct numbfs_bitmap *bm)
+{
+	kvfree(bm->map);
+	bm->map = NULL;
+}
+
+/* set or clear @len bits from @start and dirty the bitmap blocks covering them */
+static int numbfs_bitmap_mark(struct super_block *sb, struct numbfs_bitmap *bm,
+			      int start, int len, bool set)
+{
+	int bit, err;
+
+	for (bit = start; bit < start + len; bit++) {
+		if (set)
+			__set_bit_le(bit, bm->map);
+		else
+			__clear_bit_le(bit, bm->map);
+	}
+
+	for (bit = start; bit < start + len;
+	     bit = round_down(bit, NUMBFS_BLOCKS_PER_BLOCK) + NUMBFS_BLOCKS_PER_BLOCK) {
+		err = numbfs_bitmap_dirty(sb, bm, bit);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/* a run of free data blocks, in the free extents of a group */
+struct numbfs_fext {
+	struct rb_node node;
+	int start;
+	int len;
+};
+
+static struct numbfs_fext *numbfs_fext_new(int start, int len, gfp_t gfp)
+{
+	struct numbfs_fext *fe = kmalloc(sizeof(*fe), gfp);
+
+	if (fe) {
+		fe->start = start;
+		fe->len = len;
+	}
+	return fe;
+}
+
+static void numbfs_fext_insert(struct rb_root *root, struct numbfs_fext *new)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+	struct numbfs_fext *fe;
+
+	while (*p) {
+		parent = *p;
+		fe = rb_entry(parent, struct numbfs_fext, node);
+		if (new->start < fe->start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, root);
+}
+
+static void numbfs_fext_erase(struct rb_root *root, struct numbfs_fext *fe)
+{
+	rb_erase(&fe->node, root);
+	kfree(fe);
+}
+
+/* the last free extent starting at or before @blk, or NULL */
+static struct numbfs_fext *numbfs_fext_lookup(struct rb_root *root, int blk)
+{
+	struct rb_node *n = root->rb_node;
+	struct numbfs_fext *fe, *ret = NULL;
+
+	while (n) {
+		fe = rb_entry(n, struct numbfs_fext, node);
+		if (fe->start <= blk) {
+			ret = fe;
+			n = n->rb_right;
+		} else {
+			n = n->rb_left;
+		}
+	}
+	return ret;
+}
+
+static struct numbfs_fext *numbfs_fext_next(struct rb_root *root,
+					    struct numbfs_fext *fe)
+{
+	struct rb_node *n = fe ? rb_next(&fe->node) : rb_first(root);
+
+	return n ? rb_entry(n, struct numbfs_fext, node) : NULL;
+}
+
+/* add [@start, @start + @len) to the free extents, merging the neighbours */
+static void numbfs_fext_add(struct rb_root *root, int start, int len)
+{
+	struct numbfs_fext *prev, *next;
+
+	prev = numbfs_fext_lookup(root, start);
+	next = numbfs_fext_next(root, prev);
+
+	if (prev && prev->start + prev->len == start) {
+		prev->len += len;
+		if (next && start + len == next->start) {
+			prev->len += next->len;
+			numbfs_fext_erase(root, next);
+		}
+		return;
+	}
+
+	if (next && start + len == next->start) {
+		next->start = start;
+		next->len += len;
+		return;
+	}
+
+	numbfs_fext_insert(root, numbfs_fext_new(start, len,
+						 GFP_NOFS | __GFP_NOFAIL));
+}
+
+/* remove [@start, @start + @len) from the free extent @fe */
+static void numbfs_fext_remove(struct rb_root *root, struct numbfs_fext *fe,
+			       int start, int len)
+{
+	int end = fe->start + fe->len;
+
+	if (start == fe->start) {
+		fe->start += len;
+		fe->len -= len;
+		if (!fe->len)
+			numbfs_fext_erase(root, fe);
+	} else if (start + len == end) {
+		fe->len -= len;
+	} else {
+		fe->len = start - fe->start;
+		numbfs_fext_insert(root, numbfs_fext_new(start + len,
+				   end - start - len, GFP_NOFS | __GFP_NOFAIL));
+	}
+}
+
+static void numbfs_fext_release(struct rb_root *root)
+{
+	struct numbfs_fext *fe, *tmp;
+
+	rbtree_postorder_for_each_entry_safe(fe, tmp, root, node)
+		kfree(fe);
+	*root = RB_ROOT;
+}
+
+/* build the free extents of a group and count its free blocks */
+static int numbfs_group_build(struct numbfs_superblock_info *sbi,
+			      struct numbfs_group *grp, int gs, int ge)
+{
+	unsigned long *map = sbi->bbmap.map;
+	struct numbfs_fext *fe;
+	int start, end = gs;
+
+	while (1) {
+		start = find_next_zero_bit_le(map, ge, end);
+		if (start >= ge)
+			break;
+		end = find_next_bit_le(map, ge, start);
+
+		fe = numbfs_fext_new(start, end - start, GFP_KERNEL);
+		if (!fe)
+			return -ENOMEM;
+		numbfs_fext_insert(&grp->free_extents, fe);
+		grp->free_blocks += end - start;
+	}
+	return 0;
+}
+
+static int numbfs_count_zero_bits(unsigned long *map, int start, int end)
+{
+	int count = 0, bit = start;
+
+	while (1) {
+		bit = find_next_zero_bit_le(map, end, bit);
+		if (bit >= end)
+			break;
+		start = bit;
+		bit = find_next_bit_le(map, end, bit);
+		count += bit - start;
+	}
+	return count;
+}
+
+/* set up the allocation groups from the in-memory bitmaps */
+int numbfs_groups_init(struct numbfs_superblock_info *sbi)
+{
+	int g, free_blocks = 0, free_inodes = 0, err;
+	struct numbfs_group *grp;
+
+	spin_lock_init(&sbi->rsv_lock);
+	INIT_LIST_HEAD(&sbi->rsv_windows);
+	sbi->nr_groups = max(DIV_ROUND_UP(sbi->data_blocks,
+					  NUMBFS_GROUP_BLOCKS), 1);
+	sbi->inodes_per_group = round_up(DIV_ROUND_UP(sbi->total_inodes,
+					 sbi->nr_groups), BITS_PER_LONG);
+	sbi->groups = kvcalloc(sbi->nr_groups, sizeof(*grp), GFP_KERNEL);
+	if (!sbi->groups)
+		return -ENOMEM;
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		mutex_init(&grp->lock);
+		grp->free_extents = RB_ROOT;
+		grp->bhint = numbfs_group_first_block(sbi, g);
+		grp->ihint = numbfs_group_first_inode(sbi, g);
+
+		err = numbfs_group_build(sbi, grp, grp->bhint,
+					 numbfs_group_first_block(sbi, g + 1));
+		if (err) {
+			numbfs_groups_release(sbi);
+			return err;
+		}
+		grp->free_inodes = numbfs_count_zero_bits(sbi->ibmap.map,
+				grp->ihint, numbfs_group_first_inode(sbi, g + 1));
+
+		free_blocks += grp->free_blocks;
+		free_inodes += grp->free_inodes;
+	}
+
+	/* the bitmaps are authoritative, not the superblock counters */
+	err = percpu_counter_init(&sbi->free_blocks, free_blocks, GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbi->free_inodes, free_inodes,
+					  GFP_KERNEL);
+	if (!err)
+		err = percpu_counter_init(&sbi->reserved_blocks, 0, GFP_KERNEL);
+	if (err)
+		numbfs_groups_release(sbi);
+	return err;
+}
+
+void numbfs_groups_release(struct numbfs_superblock_info *sbi)
+{
+	int g;
+
+	percpu_counter_destroy(&sbi->free_blocks);
+	percpu_counter_destroy(&sbi->free_inodes);
+	percpu_counter_destroy(&sbi->reserved_blocks);
+	if (!sbi->groups)
+		return;
+
+	for (g = 0; g < sbi->nr_groups; g++)
+		numbfs_fext_release(&sbi->groups[g].free_extents);
+	kvfree(sbi->groups);
+	sbi->groups = NULL;
+}
+
+/*
+ * Quota claims that leave fewer free blocks or inodes than this can not
+ * trust the approximate counter values.
+ */
+#define NUMBFS_COUNTER_WATERMARK	(4 * percpu_counter_batch * nr_cpu_ids)
+
+/* numbfs_claim_blocks() flags */
+#define NUMBFS_CLAIM_DELAY	0x1	/* for a delayed allocation */
+#define NUMBFS_CLAIM_META	0x2	/* may use the metadata reserve */
+
+/*
+ * Claim up to @nr of the blocks not promised to delayed allocations, either
+ * for a delayed allocation or for an immediate one.  Return the number of
+ * claimed blocks.  Near the watermark, claims serialize on s_lock and use
+ * the exact counter values.
+ */
+static int __numbfs_claim_blocks(struct numbfs_superblock_info *sbi, int nr,
+				 int flags)
+{
+	int keep = flags & NUMBFS_CLAIM_META ? 0 : numbfs_meta_reserve(sbi);
+	s64 avail;
+	bool exact;
+
+	avail = percpu_counter_read(&sbi->free_blocks) -
+		percpu_counter_read(&sbi->reserved_blocks) - keep;
+	exact = avail < nr + NUMBFS_COUNTER_WATERMARK;
+	if (exact) {
+		spin_lock(&sbi->s_lock);
+		avail = percpu_counter_sum(&sbi->free_blocks) -
+			percpu_counter_sum(&sbi->reserved_blocks) - keep;
+		nr = clamp_t(s64, avail, 0, nr);
+	}
+
+	if (flags & NUMBFS_CLAIM_DELAY)
+		percpu_counter_add(&sbi->reserved_blocks, nr);
+	else
+		percpu_counter_sub(&sbi->free_blocks, nr);
+
+	if (exact)
+		spin_unlock(&sbi->s_lock);
+	return nr;
+}
+
+static int numbfs_claim_blocks(struct super_block *sb, int nr, int flags)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	int got = __numbfs_claim_blocks(sbi, nr, flags);
+
+	/* the pending frees may make up for the rest */
+	if (got < nr && READ_ONCE(sbi->pending_blocks) &&
+	    numbfs_flush_frees(sb))
+		got += __numbfs_claim_blocks(sbi, nr - got, flags);
+	return got;
+}
+
+/* the group goal-less allocations of this CPU start from */
+static int numbfs_cpu_group(struct numbfs_superblock_info *sbi)
+{
+	return raw_smp_processor_id() % sbi->nr_groups;
+}
+
+/*
+ * Reservation windows keep the files that are appended to concurrently
+ * from interleaving their blocks.  An allocation for a regular file or a
+ * directory also takes the free blocks that follow it out of its group's
+ * free extents and keeps them in the inode's window.  The window grows
+ * with the inode, from NUMBFS_RSV_BLOCKS up to NUMBFS_RSV_MAX_BLOCKS, so
+ * that large files and directories stay in few extents.  The next
+ * allocation at the window start is served from the window.  The window
+ * blocks are still free in the bitmaps and the free counters, and go back
+ * to their group when an allocation elsewhere, a close of the file, a
+ * truncate or the eviction discards the window, or when no group has free
+ * extents left.  The windows are protected by rsv_lock.
+ */
+#define NUMBFS_RSV_BLOCKS	64
+#define NUMBFS_RSV_MAX_BLOCKS	1024
+
+static int numbfs_rsv_size(struct numbfs_inode_info *ni)
+{
+	loff_t nr = i_size_read(&ni->vfs_inode) >> NUMBFS_BLOCK_BITS;
+
+	return clamp_t(loff_t, nr, NUMBFS_RSV_BLOCKS, NUMBFS_RSV_MAX_BLOCKS);
+}
+
+static void numbfs_rsv_set(struct numbfs_superblock_info *sbi,
+			   struct numbfs_inode_info *ni, int start, int len)
+{
+	spin_lock(&sbi->rsv_lock);
+	ni->rsv_start = start;
+	ni->rsv_len = len;
+	list_add_tail(&ni->rsv_list, &sbi->rsv_windows);
+	spin_unlock(&sbi->rsv_lock);
+}
+
+/* detach the window of @ni, caller holds rsv_lock */
+static int numbfs_rsv_detach(struct numbfs_inode_info *ni, int *start)
+{
+	int len = ni->rsv_len;
+
+	*start = ni->rsv_start;
+	ni->rsv_len = 0;
+	list_del_init(&ni->rsv_list);
+	return len;
+}
+
+/* give the blocks of a detached window back to their group */
+static void numbfs_rsv_put(struct numbfs_superblock_info *sbi, int start,
+			   int len)
+{
+	struct numbfs_group *grp = &sbi->groups[start / NUMBFS_GROUP_BLOCKS];
+
+	mutex_lock(&grp->lock);
+	numbfs_fext_add(&grp->free_extents, start, len);
+	grp->free_blocks += len;
+	mutex_unlock(&grp->lock);
+}
+
+void numbfs_rsv_discard(struct numbfs_inode_info *ni)
+{
+	struct numbfs_superblock_info *sbi = ni->sbi;
+	int start, len = 0;
+
+	if (!READ_ONCE(ni->rsv_len))
+		return;
+
+	spin_lock(&sbi->rsv_lock);
+	if (ni->rsv_len)
+		len = numbfs_rsv_detach(ni, &start);
+	spin_unlock(&sbi->rsv_lock);
+
+	if (len)
+		numbfs_rsv_put(sbi, start, len);
+}
+
+/* discard all windows, return true if there were any */
+static bool numbfs_rsv_discard_all(struct numbfs_superblock_info *sbi)
+{
+	struct numbfs_inode_info *ni;
+	bool found = false;
+	int start, len;
+
+	spin_lock(&sbi->rsv_lock);
+	while (!list_empty(&sbi->rsv_windows)) {
+		ni = list_first_entry(&sbi->rsv_windows,
+				      struct numbfs_inode_info, rsv_list);
+		len = numbfs_rsv_detach(ni, &start);
+		spin_unlock(&sbi->rsv_lock);
+
+		numbfs_rsv_put(sbi, start, len);
+		found = true;
+		spin_lock(&sbi->rsv_lock);
+	}
+	spin_unlock(&sbi->rsv_lock);
+	return found;
+}
+
+/*
+ * Allocate up to @n blocks from the window of @ni if it starts at @goal,
+ * otherwise discard the window.  Return the number of allocated blocks.
+ */
+static int numbfs_rsv_balloc(struct super_block *sb,
+			     struct numbfs_inode_info *ni, int goal, int *blk,
+			     int n)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	struct numbfs_group *grp;
+	int start, len = 0;
+
+	if (!READ_ONCE(ni->rsv_len))
+		return 0;
+
+	spin_lock(&sbi->rsv_lock);
+	if (ni->rsv_len && ni->rsv_start == goal) {
+		start = goal;
+		n = min(n, ni->rsv_len);
+		ni->rsv_start += n;
+		ni->rsv_len -= n;
+		if (!ni->rsv_len)
+			list_del_init(&ni->rsv_list);
+	} else {
+		if (ni->rsv_len)
+			len = numbfs_rsv_detach(ni, &start);
+		n = 0;
+	}
+	spin_unlock(&sbi->rsv_lock);
+
+	if (len)
+		numbfs_rsv_put(sbi, start, len);
+	if (!n)
+		return 0;
+
+	/* the blocks already left the group's free extents */
+	grp = &sbi->groups[start / NUMBFS_GROUP_BLOCKS];
+	mutex_lock(&grp->lock);
+	if (numbfs_bitmap_mark(sb, &sbi->bbmap, start, n, true)) {
+		numbfs_bitmap_mark(sb, &sbi->bbmap, start, n, false);
+		numbfs_fext_add(&grp->free_extents, start, n);
+		grp->free_blocks += n;
+		n = 0;
+	}
+	mutex_unlock(&grp->lock);
+
+	*blk = start;
+	return n;
+}
+
+/*
+ * Allocate up to @n contiguous blocks in group @g, at @goal if it is free.
+ * With @ni, the free blocks following the run become the window of @ni.
+ * Return the number of allocated blocks, 0 if the group is full.
+ */
+static int numbfs_group_balloc(struct super_block *sb, int g, int goal,
+			       int *blk, int n, struct numbfs_inode_info *ni)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	struct numbfs_group *grp = &sbi->groups[g];
+	struct numbfs_fext *fe;
+	int start, err, win = 0;
+
+	if (!READ_ONCE(grp->free_blocks))
+		return 0;
+
+	mutex_lock(&grp->lock);
+	if (goal < 0)
+		goal = grp->bhint;
+
+	fe = numbfs_fext_lookup(&grp->free_extents, goal);
+	if (fe && goal < fe->start + fe->len) {
+		start = goal;
+	} else {
+		/* the next free extent, wrapping around in this group */
+		fe = numbfs_fext_next(&grp->free_extents, fe);
+		if (!fe)
+			fe = numbfs_fext_next(&grp->free_extents, NULL);
+		if (!fe) {
+			n = 0;
+			goto out;
+		}
+		start = fe->start;
+	}
+	n = min(n, fe->start + fe->len - start);
+	if (ni && !READ_ONCE(ni->rsv_len))
+		win = min(fe->start + fe->len - start - n, numbfs_rsv_size(ni));
+
+	err = numbfs_bitmap_mark(sb, &sbi->bbmap, start, n, true);
+	if (err) {
+		numbfs_bitmap_mark(sb, &sbi->bbmap, start, n, false);
+		n = err;
+		goto out;
+	}
+	numbfs_fext_remove(&grp->free_extents, fe, start, n + win);
+	if (win)
+		numbfs_rsv_set(sbi, ni, start + n, win);
+
+	grp->free_blocks -= n + win;
+	grp->bhint = start + n + win;
+	*blk = start;
+out:
+	mutex_unlock(&grp->lock);
+	return n;
+}
+
+/* see numbfs_balloc_range(), @flags are numbfs_claim_blocks() flags */
+static int __numbfs_balloc_range(struct super_block *sb,
+				 struct numbfs_inode_info *ni, int goal,
+				 int *blk, int *len, bool resv, int flags)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	int n = *len, got = 0, g, i, retry = 1;
+
+	/* take the quota first, return what is left unused */
+	if (resv) {
+		percpu_counter_sub(&sbi->reserved_blocks, n);
+		percpu_counter_sub(&sbi->free_blocks, n);
+	} else {
+		n = numbfs_claim_blocks(sb, n, flags);
+		if (!n)
+			return -ENOSPC;
+	}
+
+	if (ni) {
+		got = numbfs_rsv_balloc(sb, ni, goal, blk, n);
+		if (got)
+			goto out;
+	}
+
+again:
+	if (goal >= 0 && goal < sbi->data_blocks) {
+		g = goal / NUMBFS_GROUP_BLOCKS;
+	} else {
+		g = numbfs_cpu_group(sbi);
+		goal = -1;
+	}
+
+	for (i = 0; i < sbi->nr_groups; i++) {
+		got = numbfs_group_balloc(sb, g, goal, blk, n, ni);
+		if (got)
+			break;
+		g = (g + 1) % sbi->nr_groups;
+		goal = -1;
+	}
+
+	/* the free blocks may all be held in windows */
+	if (!got && retry-- && numbfs_rsv_discard_all(sbi))
+		goto again;
+out:
+	if (got < n) {
+		if (resv)
+			percpu_counter_add(&sbi->reserved_blocks,
+					   n - max(got, 0));
+		percpu_counter_add(&sbi->free_blocks, n - max(got, 0));
+	}
+
+	if (got <= 0) {
+		if (!got)
+			pr_err("numbfs: no free extent, but %lld free blocks\n",
+			       percpu_counter_sum(&sbi->free_blocks));
+		return got ? got : -ENOSPC;
+	}
+	*len = got;
+	return 0;
+}
+
+/**
+ * numbfs_balloc_range - Allocate a run of contiguous data blocks
+ * @sb: the super block
+ * @ni: the inode to keep a reservation window for, or NULL
+ * @goal: preferred first block, a negative @goal means no preference
+ * @blk: returns the first allocated block
+ * @len: number of wanted blocks, returns the number of allocated blocks
+ * @resv: allocate from the blocks reserved by numbfs_breserve()
+ *
+ * The run starts at @goal if it is free, otherwise at the start of the next
+ * free extent of the goal's group.  Without a goal, the CPU's group is
+ * searched first.  Other groups are only tried when that group is full.
+ * The run may be shorter than wanted, but at least one block is allocated
+ * on success.  Data allocations leave the metadata reserve alone.
+ */
+int numbfs_balloc_range(struct super_block *sb, struct numbfs_inode_info *ni,
+			int goal, int *blk, int *len, bool resv)
+{
+	return __numbfs_balloc_range(sb, ni, goal, blk, len, resv, 0);
+}
+
+/*
+ * Allocate a metadata block at or after @goal, a negative @goal means no
+ * preference.  It may use the blocks kept from data allocations.
+ */
+int numbfs_balloc(struct super_block *sb, int goal, int *blk)
+{
+	int len = 1;
+
+	return __numbfs_balloc_range(sb, NULL, goal, blk, &len, false,
+				     NUMBFS_CLAIM_META);
+}
+
+/* reserve up to @nr blocks, @nr is set to the number of reserved blocks */
+int numbfs_breserve(struct super_block *sb, int *nr)
+{
+	*nr = numbfs_claim_blocks(sb, *nr, NUMBFS_CLAIM_DELAY);
+	return *nr ? 0 : -ENOSPC;
+}
+
+void numbfs_brelease(struct super_block *sb, int nr)
+{
+	percpu_counter_sub(&NUMBFS_SB(sb)->reserved_blocks, nr);
+}
+
+/*
+ * Freed blocks are not returned to the groups right away.  The runs are
+ * queued on the superblock and returned in one pass, sorted so that each
+ * group, and with it each block bitmap block, is locked and dirtied once
+ * for all of its runs.  The pass runs from a worker, soon after large
+ * frees, and synchronously on sync and when the free space runs out.
+ * Until then the blocks stay allocated in the bitmap and can not be reused.
+ */
+struct numbfs_pfree {
+	struct list_head list;
+	int blk;
+	int len;
+};
+
+/* kick the worker at once when this many blocks are pending */
+#define NUMBFS_FREE_BATCH	1024
+#define NUMBFS_FREE_DELAY	HZ
+
+static int numbfs_pfree_cmp(void *priv, const struct list_head *a,
+			    const struct list_head *b)
+{
+	return list_entry(a, struct numbfs_pfree, list)->blk -
+	       list_entry(b, struct numbfs_pfree, list)->blk;
+}
+
+/* clear the bits of @len blocks from @blk, caller holds the group lock */
+static void numbfs_group_bfree(struct numbfs_superblock_info *sbi,
+			       struct numbfs_group *grp, int blk, int len)
+{
+	int i;
+
+	for (i = blk; i < blk + len; i++) {
+		if (WARN_ON(!test_bit_le(i, sbi->bbmap.map)))
+			return;
+	}
+	for (i = blk; i < blk + len; i++)
+		__clear_bit_le(i, sbi->bbmap.map);
+	numbfs_fext_add(&grp->free_extents, blk, len);
+	grp->free_blocks += len;
+	percpu_counter_add(&sbi->free_blocks, len);
+}
+
+static void numbfs_group_bfree_done(struct super_block *sb,
+				    struct numbfs_group *grp, int g)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+
+	if (numbfs_bitmap_dirty(sb, &sbi->bbmap,
+				numbfs_group_first_block(sbi, g)))
+		pr_err("numbfs: failed to write block bitmap of group %d\n", g);
+	mutex_unlock(&grp->lock);
+}
+
+/* discard @len data blocks from @blk, chaining the request onto @bio */
+static int numbfs_discard(struct super_block *sb, int blk, int len,
+			  struct bio **bio)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+
+	return __blkdev_issue_discard(sb->s_bdev,
+			(sector_t)numbfs_data_blk(sbi, blk) << NUMBFS_SECTOR_SHIFT,
+			(sector_t)len << NUMBFS_SECTOR_SHIFT, GFP_NOFS, bio);
+}
+
+/*
+ * Discard the runs on @head in one chained request.  This is done before
+ * the runs are returned to their groups, so the discard can not race with
+ * a reallocation of the blocks.
+ */
+static void numbfs_discard_frees(struct super_block *sb,
+				 struct list_head *head)
+{
+	struct numbfs_pfree *pf;
+	struct bio *bio = NULL;
+	int err = 0;
+
+	list_for_each_entry(pf, head, list) {
+		err = numbfs_discard(sb, pf->blk, pf->len, &bio);
+		if (err)
+			break;
+	}
+	if (bio) {
+		if (!err)
+			err = submit_bio_wait(bio);
+		bio_put(bio);
+	}
+	if (err && err != -EOPNOTSUPP)
+		pr_warn("numbfs: discard of freed blocks failed: %d\n", err);
+}
+
+/* return the runs on @head to their groups */
+static void numbfs_apply_frees(struct super_block *sb, struct list_head *head)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	struct numbfs_group *grp = NULL;
+	struct numbfs_pfree *pf;
+	int g = -1, blk, end, n;
+
+	list_sort(NULL, head, numbfs_pfree_cmp);
+	if (numbfs_test_opt(sbi, DISCARD))
+		numbfs_discard_frees(sb, head);
+
+	list_for_each_entry(pf, head, list) {
+		end = pf->blk + pf->len;
+		for (blk = pf->blk; blk < end; blk += n) {
+			if (blk / NUMBFS_GROUP_BLOCKS != g) {
+				if (grp)
+					numbfs_group_bfree_done(sb, grp, g);
+				g = blk / NUMBFS_GROUP_BLOCKS;
+				grp = &sbi->groups[g];
+				mutex_lock(&grp->lock);
+			}
+			n = min(end, numbfs_group_first_block(sbi, g + 1)) - blk;
+			numbfs_group_bfree(sbi, grp, blk, n);
+		}
+	}
+	if (grp)
+		numbfs_group_bfree_done(sb, grp, g);
+}
+
+/* return all pending runs, return true if there were any */
+bool numbfs_flush_frees(struct super_block *sb)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	struct numbfs_pfree *pf, *tmp;
+	LIST_HEAD(head);
+
+	mutex_lock(&sbi->free_mutex);
+	spin_lock(&sbi->free_lock);
+	list_splice_init(&sbi->pending_frees, &head);
+	sbi->pending_blocks = 0;
+	spin_unlock(&sbi->free_lock);
+
+	numbfs_apply_frees(sb, &head);
+	mutex_unlock(&sbi->free_mutex);
+
+	list_for_each_entry_safe(pf, tmp, &head, list)
+		kfree(pf);
+	return !list_empty(&head);
+}
+
+static void numbfs_free_workfn(struct work_struct *work)
+{
+	struct numbfs_superblock_info *sbi = container_of(to_delayed_work(work),
+			struct numbfs_superblock_info, free_work);
+
+	numbfs_flush_frees(sbi->sb);
+}
+
+void numbfs_frees_init(struct super_block *sb)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+
+	sbi->sb = sb;
+	spin_lock_init(&sbi->free_lock);
+	INIT_LIST_HEAD(&sbi->pending_frees);
+	mutex_init(&sbi->free_mutex);
+	INIT_DELAYED_WORK(&sbi->free_work, numbfs_free_workfn);
+}
+
+/* free @len data blocks from @blk */
+int numbfs_bfree_range(struct super_block *sb, int blk, int len)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	struct numbfs_pfree *pf, *last;
+	bool kick;
+
+	if (blk < 0 || len <= 0 || blk + len > sbi->data_blocks)
+		return -EINVAL;
+
+	pf = kmalloc(sizeof(*pf), GFP_NOFS);
+	if (!pf) {
+		struct numbfs_pfree one = { .blk = blk, .len = len };
+		LIST_HEAD(head);
+
+		list_add(&one.list, &head);
+		mutex_lock(&sbi->free_mutex);
+		numbfs_apply_frees(sb, &head);
+		mutex_unlock(&sbi->free_mutex);
+		return 0;
+	}
+
+	spin_lock(&sbi->free_lock);
+	/* truncate frees adjacent runs one after another */
+	last = list_empty(&sbi->pending_frees) ? NULL :
+	       list_last_entry(&sbi->pending_frees, struct numbfs_pfree, list);
+	if (last && last->blk + last->len == blk) {
+		last->len += len;
+	} else if (last && blk + len == last->blk) {
+		last->blk = blk;
+		last->len += len;
+	} else {
+		pf->blk = blk;
+		pf->len = len;
+		list_add_tail(&pf->list, &sbi->pending_frees);
+		pf = NULL;
+	}
+	sbi->pending_blocks += len;
+	kick = sbi->pending_blocks >= NUMBFS_FREE_BATCH;
+	spin_unlock(&sbi->free_lock);
+	kfree(pf);
+
+	if (kick)
+		mod_delayed_work(system_unbound_wq, &sbi->free_work, 0);
+	else
+		queue_delayed_work(system_unbound_wq, &sbi->free_work,
+				   NUMBFS_FREE_DELAY);
+	return 0;
+}
+
+int numbfs_bfree(struct super_block *sb, int blk)
+{
+	return numbfs_bfree_range(sb, blk, 1);
+}
+
+/*
+ * Discard the free extents of group @g within [@start, @end) that are at
+ * least @minlen blocks long.  Each extent is taken out of the free extents
+ * while it is discarded, so it is neither allocated nor trimmed twice, and
+ * the group lock is not held across the I/O.  The extent is claimed from
+ * the free counter meanwhile, so that claims don't succeed for blocks no
+ * group can hand out.  Only the blocks that can be claimed are trimmed.
+ * Return the number of trimmed blocks or an error.
+ */
+static int numbfs_trim_group(struct super_block *sb, int g, int start,
+			     int end, int minlen)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	struct numbfs_group *grp = &sbi->groups[g];
+	struct numbfs_fext *fe;
+	int blk = start, len, got, trimmed = 0, err = 0;
+
+	mutex_lock(&grp->lock);
+	while (blk < end) {
+		fe = numbfs_fext_lookup(&grp->free_extents, blk);
+		if (!fe || fe->start + fe->len <= blk)
+			fe = numbfs_fext_next(&grp->free_extents, fe);
+		if (!fe || fe->start >= end)
+			break;
+
+		blk = max(blk, fe->start);
+		len = min(fe->start + fe->len, end) - blk;
+		if (len < minlen) {
+			blk += len;
+			continue;
+		}
+
+		got = __numbfs_claim_blocks(sbi, len, 0);
+		if (got < minlen) {
+			percpu_counter_add(&sbi->free_blocks, got);
+			blk += len;
+			continue;
+		}
+		len = got;
+
+		numbfs_fext_remove(&grp->free_extents, fe, blk, len);
+		grp->free_blocks -= len;
+		mutex_unlock(&grp->lock);
+
+		err = blkdev_issue_discard(sb->s_bdev,
+			(sector_t)numbfs_data_blk(sbi, blk) << NUMBFS_SECTOR_SHIFT,
+			(sector_t)len << NUMBFS_SECTOR_SHIFT, GFP_NOFS);
+
+		mutex_lock(&grp->lock);
+		numbfs_fext_add(&grp->free_extents, blk, len);
+		grp->free_blocks += len;
+		percpu_counter_add(&sbi->free_blocks, len);
+		if (err)
+			break;
+
+		trimmed += len;
+		blk += len;
+		if (fatal_signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		mutex_unlock(&grp->lock);
+		cond_resched();
+		mutex_lock(&grp->lock);
+	}
+	mutex_unlock(&grp->lock);
+	return err ? err : trimmed;
+}
+
+/**
+ * numbfs_trim_fs - Discard the free data blocks in a range, for FITRIM
+ * @sb: the super block
+ * @range: byte range and minimum extent length, returns the trimmed bytes
+ *
+ * Offsets are relative to the start of the data area.  Pending frees are
+ * returned first, so recently freed blocks are trimmed as well.
+ */
+int numbfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	u64 start, end, minlen, trimmed = 0;
+	int g, ret = 0;
+
+	start = range->start >> NUMBFS_BLOCK_BITS;
+	end = min_t(u64, start + (range->len >> NUMBFS_BLOCK_BITS),
+		    sbi->data_blocks);
+	minlen = max_t(u64, range->minlen >> NUMBFS_BLOCK_BITS, 1);
+	if (start >= sbi->data_blocks || minlen > NUMBFS_GROUP_BLOCKS) {
+		range->len = 0;
+		return -EINVAL;
+	}
+
+	numbfs_flush_frees(sb);
+
+	for (g = start / NUMBFS_GROUP_BLOCKS; g < sbi->nr_groups; g++) {
+		int gs = numbfs_group_first_block(sbi, g);
+		int ge = numbfs_group_first_block(sbi, g + 1);
+
+		if (gs >= end)
+			break;
+		ret = numbfs_trim_group(sb, g, max_t(u64, gs, start),
+					min_t(u64, ge, end), minlen);
+		if (ret < 0)
+			break;
+		trimmed += ret;
+		ret = 0;
+	}
+
+	range->len = trimmed << NUMBFS_BLOCK_BITS;
+	return ret;
+}
+
+/*
+ * Orlov-style spreading of top-level directories: starting from a random
+ * group, pick the first group with at least the average number of free
+ * inodes.
+ */
+static int numbfs_orlov_group(struct numbfs_superblock_info *sbi)
+{
+	int i, g, avg;
+
+	avg = max_t(s64, percpu_counter_read_positive(&sbi->free_inodes) /
+			 sbi->nr_groups, 1);
+	g = get_random_u32_below(sbi->nr_groups);
+	for (i = 0; i < sbi->nr_groups; i++, g = (g + 1) % sbi->nr_groups)
+		if (READ_ONCE(sbi->groups[g].free_inodes) >= avg)
+			return g;
+	return numbfs_cpu_group(sbi);
+}
+
+/* allocate an inode in group @g, at or after @goal if it is in this group */
+static int numbfs_group_ialloc(struct super_block *sb, int g, int goal)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	struct numbfs_group *grp = &sbi->groups[g];
+	unsigned long *map = sbi->ibmap.map;
+	int gs = numbfs_group_first_inode(sbi, g);
+	int ge = numbfs_group_first_inode(sbi, g + 1);
+	int start, bit, err;
+
+	if (!READ_ONCE(grp->free_inodes))
+		return -ENOSPC;
+
+	mutex_lock(&grp->lock);
+	start = goal >= gs && goal < ge ? goal : grp->ihint;
+	bit = find_next_zero_bit_le(map, ge, start);
+	if (bit >= ge) {
+		bit = find_next_zero_bit_le(map, start, gs);
+		if (bit >= start) {
+			err = -ENOSPC;
+			goto out;
+		}
+	}
+
+	__set_bit_le(bit, map);
+	err = numbfs_bitmap_dirty(sb, &sbi->ibmap, bit);
+	if (err) {
+		__clear_bit_le(bit, map);
+		goto out;
+	}
+
+	grp->free_inodes--;
+	grp->ihint = bit + 1;
+	err = bit;
+out:
+	mutex_unlock(&grp->lock);
+	return err;
+}
+
+/*
+ * Allocate an inode for a new child of @dir.  Top-level directories are
+ * spread over the groups, everything else is placed next to its parent so
+ * that a directory and its children share inode table blocks.
+ */
+int numbfs_ialloc(struct inode *dir, umode_t mode, int *nid)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(dir->i_sb);
+	int i, g, goal, res = -ENOSPC;
+
+	if (percpu_counter_read(&sbi->free_inodes) > NUMBFS_COUNTER_WATERMARK) {
+		percpu_counter_dec(&sbi->free_inodes);
+	} else {
+		spin_lock(&sbi->s_lock);
+		if (percpu_counter_sum(&sbi->free_inodes) <= 0) {
+			spin_unlock(&sbi->s_lock);
+			return -ENOSPC;
+		}
+		percpu_counter_dec(&sbi->free_inodes);
+		spin_unlock(&sbi->s_lock);
+	}
+
+	if (S_ISDIR(mode) && dir->i_ino == NUMBFS_ROOT_NID) {
+		g = numbfs_orlov_group(sbi);
+		goal = -1;
+	} else {
+		g = dir->i_ino / sbi->inodes_per_group;
+		goal = dir->i_ino;
+	}
+
+	for (i = 0; i < sbi->nr_groups; i++) {
+		res = numbfs_group_ialloc(dir->i_sb, g, goal);
+		if (res != -ENOSPC)
+			break;
+		g = (g + 1) % sbi->nr_groups;
+	}
+
+	if (res < 0) {
+		percpu_counter_inc(&sbi->free_inodes);
+		return res;
+	}
+	*nid = res;
+	return 0;
+}
+
+int numbfs_ifree(struct super_block *sb, int nid)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	struct numbfs_group *grp;
+	int err;
+
+	if (nid < 0 || nid >= sbi->total_inodes)
+		return -EINVAL;
+
+	grp = &sbi->groups[nid / sbi->inodes_per_group];
+	mutex_lock(&grp->lock);
+	if (WARN_ON(!__test_and_clear_bit_le(nid, sbi->ibmap.map))) {
+		mutex_unlock(&grp->lock);
+		return 0;
+	}
+
+	err = numbfs_bitmap_dirty(sb, &sbi->ibmap, nid);
+	if (err) {
+		__set_bit_le(nid, sbi->ibmap.map);
+		mutex_unlock(&grp->lock);
+		return err;
+	}
+	grp->free_inodes++;
+	mutex_unlock(&grp->lock);
+
+	percpu_counter_inc(&sbi->free_inodes);
+	return 0;
+}
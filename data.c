@@ -7,82 +7,215 @@
 #include <linux/buffer_head.h>
 #include <linux/mpage.h>
 #include <linux/iomap.h>
+#include <linux/splice.h>
+#include <linux/falloc.h>
+#include <linux/blkdev.h>
 
+/*
+ * Metadata blocks are cached in the page cache of the block device, one
+ * buffer_head per NumbFS block.  Lookups of cached blocks are shared by
+ * all the users, and modified blocks are only marked dirty here: they are
+ * written back later by the block device writeback, by sync(2), or
+ * explicitly via numbfs_bsync().
+ */
 int numbfs_binit(struct numbfs_buf *buf, struct block_device *bdev,
 		 int blk)
 {
-	struct folio *folio;
+	struct buffer_head *bh;
 
-	folio = folio_alloc(GFP_KERNEL, 0);
-	if (!folio)
+	buf->inode = NULL;
+	buf->folio = NULL;
+	buf->base = NULL;
+	buf->blkaddr = blk;
+
+	bh = __getblk(bdev, blk, NUMBFS_BYTES_PER_BLOCK);
+	if (!bh) {
+		buf->bh = NULL;
 		return -ENOMEM;
+	}
 
-	buf->bdev = bdev;
-	buf->folio = folio;
-	buf->blkaddr = blk;
-	buf->base = kmap_local_folio(folio, 0);
+	buf->bh = bh;
+	buf->base = bh->b_data;
 	return 0;
 }
 
 void numbfs_bput(struct numbfs_buf *buf)
 {
-	if (!buf->folio)
+	if (!buf->bh)
 		return;
 
-	kunmap_local(buf->base);
 	buf->base = NULL;
-	folio_put(buf->folio);
-	buf->folio = NULL;
+	brelse(buf->bh);
+	buf->bh = NULL;
 }
 
-int numbfs_brw(struct numbfs_buf *buf, int read)
+int numbfs_brw(struct numbfs_buf *buf, int rw)
 {
-	struct bio *bio;
-	int err;
+	struct buffer_head *bh = buf->bh;
 
-	bio = bio_alloc(buf->bdev, 1,
-			read == NUMBFS_READ ? REQ_OP_READ : REQ_OP_WRITE,
-			GFP_NOFS);
-	if (!bio)
-		return -ENOMEM;
+	if (rw == NUMBFS_WRITE) {
+		/* write back later */
+		mark_buffer_dirty(bh);
+		return 0;
+	}
 
-	bio->bi_iter.bi_sector = buf->blkaddr;
-	err = bio_add_folio(bio, buf->folio, folio_size(buf->folio), 0);
-	if (!err)
+	/* cache hit, no need to issue any I/O */
+	if (buffer_uptodate(bh))
+		return 0;
+
+	if (bh_read(bh, 0) < 0) {
+		pr_err("numbfs: failed to read block@%d\n", buf->blkaddr);
 		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Overwrite the whole block with @data, or zeroes if @data is NULL.  The
+ * block is fully overwritten, so there is no need to read it from disk
+ * first.
+ */
+void numbfs_bcopy(struct numbfs_buf *buf, const void *data)
+{
+	struct buffer_head *bh = buf->bh;
 
-	/* here, let's wait the bio complete */
-	err = submit_bio_wait(bio);
-	bio_put(bio);
+	lock_buffer(bh);
+	if (data)
+		memcpy(bh->b_data, data, NUMBFS_BYTES_PER_BLOCK);
+	else
+		memset(bh->b_data, 0, NUMBFS_BYTES_PER_BLOCK);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+}
 
-	return err;
+/* initialize a freshly allocated block with zeroes */
+void numbfs_bzero(struct numbfs_buf *buf)
+{
+	numbfs_bcopy(buf, NULL);
 }
 
+/* write the dirty buffer to disk and wait for its completion */
+int numbfs_bsync(struct numbfs_buf *buf)
+{
+	if (!buffer_dirty(buf->bh))
+		return 0;
+
+	return sync_dirty_buffer(buf->bh);
+}
+
+/*
+ * Start the I/O of a buffer without waiting for it.  Reading a cached
+ * block or writing a clean block does nothing.  Callers that touch
+ * several blocks should submit all of them under a blk_plug and wait
+ * for them afterwards with numbfs_bwait(), so that the block layer
+ * dispatches them together.
+ */
+void numbfs_bsubmit(struct numbfs_buf *buf, int rw)
+{
+	if (rw == NUMBFS_WRITE)
+		write_dirty_buffer(buf->bh, REQ_SYNC);
+	else
+		bh_read_nowait(buf->bh, REQ_META);
+}
+
+/* wait for the I/O started by numbfs_bsubmit() */
+int numbfs_bwait(struct numbfs_buf *buf)
+{
+	wait_on_buffer(buf->bh);
+	if (!buffer_uptodate(buf->bh)) {
+		pr_err("numbfs: I/O error on block@%d\n", buf->blkaddr);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* issue the I/O of @nr buffers at once and wait for all of them */
+int numbfs_brw_batch(struct numbfs_buf *bufs, int nr, int rw)
+{
+	struct blk_plug plug;
+	int i, err, ret = 0;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++)
+		numbfs_bsubmit(&bufs[i], rw);
+	blk_finish_plug(&plug);
+
+	for (i = 0; i < nr; i++) {
+		err = numbfs_bwait(&bufs[i]);
+		if (err && !ret)
+			ret = err;
+	}
+	return ret;
+}
+
+/* start reading @nr blocks from @blk into the cache, don't wait for them */
+void numbfs_breadahead(struct block_device *bdev, int blk, int nr)
+{
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	int i;
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		bh = __getblk(bdev, blk + i, NUMBFS_BYTES_PER_BLOCK);
+		if (!bh)
+			break;
+		bh_readahead(bh, REQ_RAHEAD | REQ_META);
+		brelse(bh);
+	}
+	blk_finish_plug(&plug);
+}
+
+/* numbfs_iomap() type, in addition to NUMBFS_READ and NUMBFS_WRITE */
+#define NUMBFS_RESERVE	2
+
 static int numbfs_iomap(struct inode *inode, loff_t offset, loff_t length,
 			struct iomap *iomap, int type)
 {
 	struct numbfs_inode_info *ni = NUMBFS_I(inode);
-	int blk;
+	struct numbfs_map map;
+	loff_t end = offset + max_t(loff_t, length, 1);
+	int err;
 
-	blk = numbfs_iaddrspace_blkaddr(ni, offset, type == NUMBFS_WRITE);
-	if (blk < 0 && blk != NUMBFS_HOLE)
-		return -EINVAL;
+	map.m_lblk = offset >> NUMBFS_BLOCK_BITS;
+	map.m_len = min_t(loff_t, DIV_ROUND_UP(end, NUMBFS_BYTES_PER_BLOCK) -
+			  map.m_lblk, INT_MAX);
+	if (type == NUMBFS_RESERVE)
+		err = numbfs_iaddrspace_reserve(ni, &map);
+	else
+		err = numbfs_iaddrspace_map(ni, &map, type == NUMBFS_WRITE);
+	if (err)
+		return err;
 
 	iomap->flags = 0;
-	iomap->offset = (offset >> NUMBFS_BLOCK_BITS) << NUMBFS_BLOCK_BITS;
+	iomap->offset = (loff_t)map.m_lblk << NUMBFS_BLOCK_BITS;
 	iomap->bdev = inode->i_sb->s_bdev;
-	iomap->length = 1 << NUMBFS_BLOCK_BITS;
+	iomap->length = (loff_t)map.m_len << NUMBFS_BLOCK_BITS;
 	iomap->private = NULL;
+	iomap->validity_cookie = map.m_seq;
 
-	if (blk == NUMBFS_HOLE) {
+	if (map.m_flags & NUMBFS_MAP_DELALLOC) {
+		iomap->type = IOMAP_DELALLOC;
+		iomap->addr = IOMAP_NULL_ADDR;
+		if (map.m_flags & NUMBFS_MAP_NEW)
+			iomap->flags |= IOMAP_F_NEW;
+		return 0;
+	}
+
+	if (map.m_pblk == NUMBFS_HOLE) {
 		iomap->type = IOMAP_HOLE;
 		iomap->addr = IOMAP_NULL_ADDR;
-		iomap->flags |= IOMAP_F_NEW;
 		return 0;
 	}
 
-	iomap->type = IOMAP_MAPPED;
-	iomap->addr = numbfs_data_blk(ni->sbi, blk) << NUMBFS_BLOCK_BITS;
+	if (map.m_flags & NUMBFS_MAP_UNWRITTEN)
+		iomap->type = IOMAP_UNWRITTEN;
+	else
+		iomap->type = IOMAP_MAPPED;
+	iomap->addr = (u64)numbfs_data_blk(ni->sbi, map.m_pblk) << NUMBFS_BLOCK_BITS;
+	if (map.m_flags & NUMBFS_MAP_NEW)
+		iomap->flags |= IOMAP_F_NEW;
 	return 0;
 }
 
@@ -102,15 +235,127 @@ static int numbfs_read_folio(struct file *file, struct folio *folio)
 	return iomap_read_folio(folio, &numbfs_iomap_read_ops);
 }
 
+static void numbfs_readahead(struct readahead_control *rac)
+{
+	iomap_readahead(rac, &numbfs_iomap_read_ops);
+}
+
+int numbfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		  u64 start, u64 len)
+{
+	int err;
+
+	inode_lock_shared(inode);
+	err = iomap_fiemap(inode, fieinfo, start, len, &numbfs_iomap_read_ops);
+	inode_unlock_shared(inode);
+	return err;
+}
+
 static int numbfs_map_blocks(struct iomap_writepage_ctx *wpc,
 			     struct inode *inode, loff_t offset)
 {
-	return numbfs_iomap(inode, offset, NUMBFS_BYTES_PER_BLOCK,
-			    &wpc->iomap, NUMBFS_WRITE);
+	struct iomap *iomap = &wpc->iomap;
+
+	/*
+	 * The previous mapping still covers this block, unless a punch, a
+	 * truncate or a conversion changed the mapping since it was taken.
+	 */
+	if ((iomap->type == IOMAP_MAPPED || iomap->type == IOMAP_UNWRITTEN) &&
+	    offset >= iomap->offset && offset < iomap->offset + iomap->length &&
+	    iomap->validity_cookie == READ_ONCE(NUMBFS_I(inode)->map_seq))
+		return 0;
+
+	/* map as far as i_size, holes are still allocated one by one */
+	return numbfs_iomap(inode, offset,
+			    max_t(loff_t, i_size_read(inode) - offset,
+				  NUMBFS_BYTES_PER_BLOCK),
+			    iomap, NUMBFS_WRITE);
+}
+
+/* mark the blocks of [@offset, @offset + @size) written */
+static int numbfs_convert(struct inode *inode, loff_t offset, loff_t size)
+{
+	int lblk = offset >> NUMBFS_BLOCK_BITS;
+	int err;
+
+	err = numbfs_iaddrspace_convert(NUMBFS_I(inode), lblk,
+			DIV_ROUND_UP(offset + size, NUMBFS_BYTES_PER_BLOCK) - lblk);
+	if (err)
+		pr_err("numbfs: failed to convert unwritten blocks of inode@%lu, err:%d\n",
+		       inode->i_ino, err);
+	return err;
+}
+
+/*
+ * Writeback into unwritten blocks completes in the endio workqueue, which
+ * marks the blocks written once the data is on disk.
+ */
+static void numbfs_end_bio(struct bio *bio)
+{
+	struct iomap_ioend *ioend = bio->bi_private;
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(ioend->io_inode->i_sb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&sbi->ioend_lock, flags);
+	if (list_empty(&sbi->ioend_list))
+		queue_work(sbi->endio_wq, &sbi->ioend_work);
+	list_add_tail(&ioend->io_list, &sbi->ioend_list);
+	spin_unlock_irqrestore(&sbi->ioend_lock, flags);
+}
+
+static void numbfs_end_io(struct work_struct *work)
+{
+	struct numbfs_superblock_info *sbi = container_of(work,
+			struct numbfs_superblock_info, ioend_work);
+	struct iomap_ioend *ioend;
+	LIST_HEAD(list);
+	int err;
+
+	spin_lock_irq(&sbi->ioend_lock);
+	list_splice_init(&sbi->ioend_list, &list);
+	spin_unlock_irq(&sbi->ioend_lock);
+
+	while (!list_empty(&list)) {
+		ioend = list_first_entry(&list, struct iomap_ioend, io_list);
+		list_del_init(&ioend->io_list);
+
+		err = blk_status_to_errno(ioend->io_bio->bi_status);
+		if (!err)
+			err = numbfs_convert(ioend->io_inode, ioend->io_offset,
+					     ioend->io_size);
+		iomap_finish_ioends(ioend, err);
+	}
+}
+
+int numbfs_endio_init(struct super_block *sb)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+
+	spin_lock_init(&sbi->ioend_lock);
+	INIT_LIST_HEAD(&sbi->ioend_list);
+	INIT_WORK(&sbi->ioend_work, numbfs_end_io);
+	sbi->endio_wq = alloc_workqueue("numbfs-endio/%s",
+			WQ_MEM_RECLAIM | WQ_FREEZABLE, 0, sb->s_id);
+	return sbi->endio_wq ? 0 : -ENOMEM;
+}
+
+void numbfs_endio_destroy(struct numbfs_superblock_info *sbi)
+{
+	if (sbi->endio_wq)
+		destroy_workqueue(sbi->endio_wq);
+	sbi->endio_wq = NULL;
+}
+
+static int numbfs_prepare_ioend(struct iomap_ioend *ioend, int status)
+{
+	if (ioend->io_type == IOMAP_UNWRITTEN)
+		ioend->io_bio->bi_end_io = numbfs_end_bio;
+	return status;
 }
 
 static const struct iomap_writeback_ops numbfs_writeback_ops = {
 	.map_blocks = numbfs_map_blocks,
+	.prepare_ioend = numbfs_prepare_ioend,
 };
 
 static int numbfs_writepages(struct address_space *mapping,
@@ -123,38 +368,395 @@ static int numbfs_writepages(struct address_space *mapping,
 
 const struct address_space_operations numbfs_aops = {
 	.read_folio             = numbfs_read_folio,
+	.readahead              = numbfs_readahead,
+	.direct_IO              = noop_direct_IO,
 	.writepages             = numbfs_writepages,
+	.dirty_folio            = iomap_dirty_folio,
 	.release_folio          = iomap_release_folio,
 	.invalidate_folio       = iomap_invalidate_folio,
+	.migrate_folio          = filemap_migrate_folio,
+	.is_partially_uptodate  = iomap_is_partially_uptodate,
+	.error_remove_folio     = generic_error_remove_folio,
 };
 
 static int numbfs_iomap_write_begin(struct inode *inode, loff_t offset,
 		loff_t length, unsigned int flags, struct iomap *iomap,
 		struct iomap *srcmap)
 {
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(inode->i_sb);
+
+	/* zeroing leaves holes and unwritten blocks alone */
+	if (flags & IOMAP_ZERO)
+		return numbfs_iomap(inode, offset, length, iomap, NUMBFS_READ);
+
+	/* buffered writes only reserve blocks, writeback allocates them */
+	if (!(flags & IOMAP_DIRECT) && numbfs_test_opt(sbi, DELALLOC))
+		return numbfs_iomap(inode, offset, length, iomap,
+				    NUMBFS_RESERVE);
+
 	return numbfs_iomap(inode, offset, length, iomap, NUMBFS_WRITE);
 }
 
+static int numbfs_da_punch(struct inode *inode, loff_t offset, loff_t length)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(inode);
+
+	down_write(&ni->map_sem);
+	numbfs_da_release(ni, offset >> NUMBFS_BLOCK_BITS,
+			  ((offset + length) >> NUMBFS_BLOCK_BITS) - 1);
+	up_write(&ni->map_sem);
+	return 0;
+}
+
+static int numbfs_iomap_write_end(struct inode *inode, loff_t pos,
+		loff_t length, ssize_t written, unsigned int flags,
+		struct iomap *iomap)
+{
+	/* a short write leaves blocks it reserved without dirty folios */
+	return iomap_file_buffered_write_punch_delalloc(inode, iomap, pos,
+			length, written, numbfs_da_punch);
+}
+
 const struct iomap_ops numbfs_iomap_write_ops = {
 	.iomap_begin    = numbfs_iomap_write_begin,
+	.iomap_end      = numbfs_iomap_write_end,
+};
+
+static int numbfs_dio_write_end_io(struct kiocb *iocb, ssize_t size,
+				   int error, unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t end = iocb->ki_pos + size;
+
+	if (error)
+		return error;
+
+	if (size && (flags & IOMAP_DIO_UNWRITTEN)) {
+		error = numbfs_convert(inode, iocb->ki_pos, size);
+		if (error)
+			return error;
+	}
+
+	/* extending writes complete under the inode lock */
+	if (size && end > i_size_read(inode)) {
+		i_size_write(inode, end);
+		mark_inode_dirty(inode);
+	}
+	return 0;
+}
+
+static const struct iomap_dio_ops numbfs_dio_write_ops = {
+	.end_io         = numbfs_dio_write_end_io,
 };
 
+static ssize_t numbfs_dio_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
+	}
+
+	ret = iomap_dio_rw(iocb, to, &numbfs_iomap_read_ops, NULL, 0, NULL, 0);
+	inode_unlock_shared(inode);
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
 static ssize_t numbfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	if (!iov_iter_count(to))
 		return 0;
 
+	if (iocb->ki_flags & IOCB_DIRECT)
+		return numbfs_dio_read_iter(iocb, to);
+
 	return filemap_read(iocb, to, 0);
 }
 
+static ssize_t numbfs_dio_write_iter(struct kiocb *iocb,
+				     struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	unsigned int dio_flags = 0;
+	ssize_t ret, buffered;
+
+	/* i_size is updated at completion, which must not race with others */
+	if (iocb->ki_pos + iov_iter_count(from) > i_size_read(inode))
+		dio_flags |= IOMAP_DIO_FORCE_WAIT;
+
+	ret = iomap_dio_rw(iocb, from, &numbfs_iomap_write_ops,
+			   &numbfs_dio_write_ops, dio_flags, NULL, 0);
+	/* the page cache could not be invalidated, use buffered I/O */
+	if (ret == -ENOTBLK)
+		ret = 0;
+	if (ret < 0 || !iov_iter_count(from))
+		return ret;
+
+	/* finish a short direct write with buffered I/O */
+	buffered = iomap_file_buffered_write(iocb, from,
+					     &numbfs_iomap_write_ops);
+	return direct_write_fallback(iocb, from, ret, buffered);
+}
+
 static ssize_t numbfs_file_write_iter(struct kiocb *iocb,
 				      struct iov_iter *from)
 {
-	return iomap_file_buffered_write(iocb, from, &numbfs_iomap_write_ops);
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock(inode);
+	}
+
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out;
+
+	ret = file_modified(iocb->ki_filp);
+	if (ret)
+		goto out;
+
+	if (iocb->ki_flags & IOCB_DIRECT) {
+		ret = numbfs_dio_write_iter(iocb, from);
+	} else {
+		ret = iomap_file_buffered_write(iocb, from,
+						&numbfs_iomap_write_ops);
+	}
+out:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static vm_fault_t numbfs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+
+	/* keep truncate away while blocks are allocated for the folio */
+	filemap_invalidate_lock_shared(inode->i_mapping);
+	ret = iomap_page_mkwrite(vmf, &numbfs_iomap_write_ops);
+	filemap_invalidate_unlock_shared(inode->i_mapping);
+
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct numbfs_file_vm_ops = {
+	.fault          = filemap_fault,
+	.map_pages      = filemap_map_pages,
+	.page_mkwrite   = numbfs_page_mkwrite,
+};
+
+static int numbfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &numbfs_file_vm_ops;
+	return 0;
+}
+
+static ssize_t numbfs_copy_file_range(struct file *file_in, loff_t pos_in,
+				      struct file *file_out, loff_t pos_out,
+				      size_t len, unsigned int flags)
+{
+	if (file_inode(file_in)->i_sb != file_inode(file_out)->i_sb)
+		return -EXDEV;
+
+	/* copy from the page cache of @file_in, no user-space round trip */
+	return splice_copy_file_range(file_in, pos_in, file_out, pos_out, len);
+}
+
+static int numbfs_file_release(struct inode *inode, struct file *file)
+{
+	/* the writer is done appending, give its window back */
+	if (file->f_mode & FMODE_WRITE)
+		numbfs_rsv_discard(NUMBFS_I(inode));
+	return 0;
+}
+
+/* zero [@offset, @offset + @len) in the page cache, up to i_size */
+static int numbfs_zero_partial(struct inode *inode, loff_t offset, loff_t len)
+{
+	len = min(len, i_size_read(inode) - offset);
+	if (len <= 0)
+		return 0;
+	return iomap_zero_range(inode, offset, len, NULL,
+				&numbfs_iomap_write_ops);
+}
+
+/*
+ * Zero the partial blocks at both ends of [@offset, @offset + @len), drop
+ * the page cache of the whole blocks in between and free their blocks.
+ */
+static int numbfs_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
+	loff_t end = offset + len;
+	loff_t start = round_up(offset, NUMBFS_BYTES_PER_BLOCK);
+	loff_t stop = round_down(end, NUMBFS_BYTES_PER_BLOCK);
+	int err;
+
+	err = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+	if (err)
+		return err;
+
+	if (start >= stop)
+		return numbfs_zero_partial(inode, offset, len);
+
+	err = numbfs_zero_partial(inode, offset, start - offset);
+	if (!err)
+		err = numbfs_zero_partial(inode, stop, end - stop);
+	if (err)
+		return err;
+
+	truncate_pagecache_range(inode, start, stop - 1);
+	return numbfs_iaddrspace_punch(NUMBFS_I(inode),
+				       start >> NUMBFS_BLOCK_BITS,
+				       (stop - start) >> NUMBFS_BLOCK_BITS);
+}
+
+/* allocate unwritten blocks for the holes of [@offset, @offset + @len) */
+static int numbfs_prealloc(struct inode *inode, loff_t offset, loff_t len)
+{
+	int lblk = offset >> NUMBFS_BLOCK_BITS;
+
+	return numbfs_iaddrspace_prealloc(NUMBFS_I(inode), lblk,
+			DIV_ROUND_UP(offset + len, NUMBFS_BYTES_PER_BLOCK) - lblk);
+}
+
+/* the whole blocks are replaced by unwritten ones, which read as zeroes */
+static int numbfs_zero_range(struct inode *inode, loff_t offset, loff_t len)
+{
+	loff_t start = round_up(offset, NUMBFS_BYTES_PER_BLOCK);
+	loff_t stop = round_down(offset + len, NUMBFS_BYTES_PER_BLOCK);
+	int err;
+
+	err = numbfs_punch_hole(inode, offset, len);
+	if (err || start >= stop)
+		return err;
+	return numbfs_prealloc(inode, start, stop - start);
+}
+
+static long numbfs_fallocate(struct file *file, int mode, loff_t offset,
+			     loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	loff_t end = offset + len;
+	int err;
+
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+		     FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+
+	/* unwritten blocks are kept in extents */
+	if (!numbfs_has_extent(NUMBFS_SB(inode->i_sb)))
+		return -EOPNOTSUPP;
+
+	inode_lock(inode);
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		err = inode_newsize_ok(inode, end);
+		if (err)
+			goto out;
+	}
+
+	err = file_modified(file);
+	if (err)
+		goto out;
+
+	/* keep direct I/O and page faults away from the blocks */
+	inode_dio_wait(inode);
+	filemap_invalidate_lock(inode->i_mapping);
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+		err = numbfs_punch_hole(inode, offset, len);
+	else if (mode & FALLOC_FL_ZERO_RANGE)
+		err = numbfs_zero_range(inode, offset, len);
+	else
+		err = numbfs_prealloc(inode, offset, len);
+	filemap_invalidate_unlock(inode->i_mapping);
+	if (err)
+		goto out;
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+		truncate_setsize(inode, end);
+		mark_inode_dirty(inode);
+	}
+out:
+	inode_unlock(inode);
+	return err;
+}
+
+static loff_t numbfs_file_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+
+	switch (whence) {
+	case SEEK_HOLE:
+		inode_lock_shared(inode);
+		offset = iomap_seek_hole(inode, offset, &numbfs_iomap_read_ops);
+		inode_unlock_shared(inode);
+		break;
+	case SEEK_DATA:
+		inode_lock_shared(inode);
+		offset = iomap_seek_data(inode, offset, &numbfs_iomap_read_ops);
+		inode_unlock_shared(inode);
+		break;
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+
+	if (offset < 0)
+		return offset;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * Data and directory blocks are written back by writeback, so fsync() is
+ * what makes them durable.  The inode, bitmaps, extent and index blocks
+ * are all cached in the block device's mapping.
+ */
+int numbfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct inode *inode = file->f_mapping->host;
+	struct block_device *bdev = inode->i_sb->s_bdev;
+	int err;
+
+	err = file_write_and_wait_range(file, start, end);
+	if (err)
+		return err;
+
+	err = sync_inode_metadata(inode, 1);
+	if (err)
+		return err;
+
+	err = sync_blockdev(bdev);
+	if (err)
+		return err;
+
+	return blkdev_issue_flush(bdev);
 }
 
 const struct file_operations numbfs_file_fops = {
-	.llseek         = generic_file_llseek,
+	.llseek         = numbfs_file_llseek,
 	.read_iter      = numbfs_file_read_iter,
 	.write_iter     = numbfs_file_write_iter,
+	.mmap           = numbfs_file_mmap,
+	.splice_read    = filemap_splice_read,
+	.splice_write   = iter_file_splice_write,
+	.copy_file_range = numbfs_copy_file_range,
+	.fallocate      = numbfs_fallocate,
+	.fsync          = numbfs_fsync,
+	.release        = numbfs_file_release,
+	.unlocked_ioctl = numbfs_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
 };
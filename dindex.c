@@ -0,0 +1,468 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+/*
+ * numbfs directory index (NUMBFS_FEATURE_DIR_INDEX)
+ *
+ * The dirents stay in the dense array of the directory's data blocks.  Once
+ * a directory outgrows its first block, a B+tree of name hashes is built
+ * next to them, which maps every name hash to the positions of the dirents
+ * with that hash.  A lookup reads one index block per level and the block
+ * of the matching dirent, however large the directory is.
+ *
+ * The root of the tree never moves, a full root is grown by moving its
+ * entries to a new child.  Full blocks are split on the way down, so an
+ * insertion never goes back up.  Leaves are split between two hashes, all
+ * the entries of a hash are in one leaf.  Blocks are never merged.
+ */
+
+#include "internal.h"
+
+struct numbfs_dx_frame {
+	struct numbfs_buf buf;
+	struct numbfs_dx_header *dh;
+	struct numbfs_dx_entry *de;
+	int blk;
+};
+
+/* FNV-1a, the hashes are on disk and must not depend on the CPU */
+static u32 numbfs_dx_hash(const char *name, int namelen)
+{
+	u32 hash = 0x811c9dc5;
+
+	while (namelen--) {
+		hash ^= (u8)*name++;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static inline int numbfs_dx_count(struct numbfs_dx_frame *f)
+{
+	return le16_to_cpu(f->dh->dh_entries);
+}
+
+static inline u32 numbfs_dx_ehash(struct numbfs_dx_frame *f, int i)
+{
+	return le32_to_cpu(f->de[i].de_hash);
+}
+
+static inline int numbfs_dx_eptr(struct numbfs_dx_frame *f, int i)
+{
+	return le32_to_cpu(f->de[i].de_ptr);
+}
+
+static void numbfs_dx_frame_init(struct numbfs_dx_frame *f, int blk)
+{
+	f->blk = blk;
+	f->dh = (struct numbfs_dx_header*)f->buf.base;
+	f->de = (struct numbfs_dx_entry*)(f->dh + 1);
+}
+
+/* read the index block @blk, which must be of @level unless it is negative */
+static int numbfs_dx_read(struct inode *dir, int blk, int level,
+			  struct numbfs_dx_frame *f)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(dir->i_sb);
+	int err;
+
+	err = numbfs_binit(&f->buf, dir->i_sb->s_bdev, numbfs_data_blk(sbi, blk));
+	if (err)
+		return err;
+
+	err = numbfs_brw(&f->buf, NUMBFS_READ);
+	if (err)
+		return err;
+
+	numbfs_dx_frame_init(f, blk);
+	if (le32_to_cpu(f->dh->dh_magic) != NUMBFS_DX_MAGIC ||
+	    numbfs_dx_count(f) > NUMBFS_DX_ENTRIES ||
+	    f->dh->dh_level > NUMBFS_DX_MAX_LEVEL ||
+	    (level >= 0 && f->dh->dh_level != level) ||
+	    (f->dh->dh_level && !numbfs_dx_count(f))) {
+		pr_err("numbfs: invalid index block@%d of directory@%lu\n",
+		       blk, dir->i_ino);
+		return -EUCLEAN;
+	}
+	return 0;
+}
+
+/* allocate an empty index block of @level */
+static int numbfs_dx_new(struct inode *dir, int level,
+			 struct numbfs_dx_frame *f)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	struct super_block *sb = dir->i_sb;
+	int blk, err;
+
+	err = numbfs_balloc(sb, ni->dx_root != NUMBFS_HOLE ? ni->dx_root :
+			    ni->xattr_start, &blk);
+	if (err)
+		return err;
+
+	err = numbfs_binit(&f->buf, sb->s_bdev, numbfs_data_blk(ni->sbi, blk));
+	if (err) {
+		numbfs_bfree(sb, blk);
+		return err;
+	}
+
+	numbfs_bzero(&f->buf);
+	numbfs_dx_frame_init(f, blk);
+	f->dh->dh_magic = cpu_to_le32(NUMBFS_DX_MAGIC);
+	f->dh->dh_level = level;
+	return 0;
+}
+
+/* the first entry of @f with a hash above @hash, or not below it if !@above */
+static int numbfs_dx_search(struct numbfs_dx_frame *f, u32 hash, bool above)
+{
+	int lo = 0, hi = numbfs_dx_count(f), mid;
+	u32 h;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		h = numbfs_dx_ehash(f, mid);
+		if (h < hash || (above && h == hash))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* the entry of an interior block whose child covers @hash */
+static int numbfs_dx_child(struct numbfs_dx_frame *f, u32 hash)
+{
+	return max(numbfs_dx_search(f, hash, true) - 1, 0);
+}
+
+static void numbfs_dx_insert(struct numbfs_dx_frame *f, int at, u32 hash,
+			     int ptr)
+{
+	int n = numbfs_dx_count(f);
+
+	memmove(&f->de[at + 1], &f->de[at], (n - at) * sizeof(*f->de));
+	f->de[at].de_hash = cpu_to_le32(hash);
+	f->de[at].de_ptr = cpu_to_le32(ptr);
+	f->dh->dh_entries = cpu_to_le16(n + 1);
+	numbfs_brw(&f->buf, NUMBFS_WRITE);
+}
+
+static void numbfs_dx_remove(struct numbfs_dx_frame *f, int at)
+{
+	int n = numbfs_dx_count(f);
+
+	memmove(&f->de[at], &f->de[at + 1], (n - at - 1) * sizeof(*f->de));
+	f->dh->dh_entries = cpu_to_le16(n - 1);
+	numbfs_brw(&f->buf, NUMBFS_WRITE);
+}
+
+/* read the leaf that covers @hash, the caller puts @f->buf */
+static int numbfs_dx_leaf(struct inode *dir, u32 hash,
+			  struct numbfs_dx_frame *f)
+{
+	int blk = NUMBFS_I(dir)->dx_root, level = -1, err;
+
+	while (1) {
+		err = numbfs_dx_read(dir, blk, level, f);
+		if (err || !f->dh->dh_level)
+			return err;
+
+		level = f->dh->dh_level - 1;
+		blk = numbfs_dx_eptr(f, numbfs_dx_child(f, hash));
+		numbfs_bput(&f->buf);
+	}
+}
+
+/*
+ * Leaves point to the slots of fixed-size dirents, and to the byte offsets
+ * of compact dirents, which have no slots.  The callers use byte offsets.
+ */
+static int numbfs_dx_ptr(struct inode *dir, int pos)
+{
+	if (numbfs_has_compact_dirent(NUMBFS_SB(dir->i_sb)))
+		return pos;
+	return pos / sizeof(struct numbfs_dirent);
+}
+
+static int numbfs_dx_pos(struct inode *dir, int ptr)
+{
+	if (numbfs_has_compact_dirent(NUMBFS_SB(dir->i_sb)))
+		return ptr;
+	return ptr * sizeof(struct numbfs_dirent);
+}
+
+int numbfs_dx_lookup(struct inode *dir, const char *name, int namelen,
+		     int *nid, int *offset)
+{
+	u32 hash = numbfs_dx_hash(name, namelen);
+	struct numbfs_dx_frame f;
+	struct numbfs_dent d;
+	struct numbfs_buf buf;
+	int i, pos, err;
+
+	numbfs_ibuf_init(&buf, dir, 0);
+	err = numbfs_dx_leaf(dir, hash, &f);
+	if (err)
+		goto out;
+
+	err = -ENOENT;
+	for (i = numbfs_dx_search(&f, hash, false);
+	     i < numbfs_dx_count(&f) && numbfs_dx_ehash(&f, i) == hash; i++) {
+		pos = numbfs_dx_pos(dir, numbfs_dx_eptr(&f, i));
+		if (pos >= i_size_read(dir)) {
+			pr_err("numbfs: index of directory@%lu points past its end\n",
+			       dir->i_ino);
+			err = -EUCLEAN;
+			break;
+		}
+
+		err = numbfs_dir_get(dir, pos, &buf, &d);
+		if (err)
+			break;
+
+		err = -ENOENT;
+		if (d.namelen == namelen && !memcmp(d.name, name, namelen)) {
+			*nid = d.ino;
+			if (offset)
+				*offset = pos;
+			err = 0;
+			break;
+		}
+	}
+out:
+	numbfs_ibuf_put(&buf);
+	numbfs_bput(&f.buf);
+	return err;
+}
+
+/* move the entries of the full root to a new child, one level down */
+static int numbfs_dx_grow(struct inode *dir, struct numbfs_dx_frame *root)
+{
+	int level = root->dh->dh_level, err;
+	struct numbfs_dx_frame c;
+
+	if (level == NUMBFS_DX_MAX_LEVEL)
+		return -ENOSPC;
+
+	err = numbfs_dx_new(dir, level, &c);
+	if (err)
+		return err;
+
+	memcpy(c.de, root->de, numbfs_dx_count(root) * sizeof(*c.de));
+	c.dh->dh_entries = root->dh->dh_entries;
+	numbfs_brw(&c.buf, NUMBFS_WRITE);
+	numbfs_bput(&c.buf);
+
+	root->dh->dh_level = level + 1;
+	root->dh->dh_entries = cpu_to_le16(1);
+	root->de[0].de_hash = 0;
+	root->de[0].de_ptr = cpu_to_le32(c.blk);
+	numbfs_brw(&root->buf, NUMBFS_WRITE);
+	return 0;
+}
+
+/*
+ * Split the full block @c, the child of entry @at of @p, by moving its
+ * upper half to a new block.  On return, @c is the half covering @hash.
+ */
+static int numbfs_dx_split(struct inode *dir, struct numbfs_dx_frame *p,
+			   int at, struct numbfs_dx_frame *c, u32 hash)
+{
+	int n = numbfs_dx_count(c), mid = n / 2, lo, hi, i, err;
+	struct numbfs_dx_frame s;
+	u32 sep;
+
+	/* keep equal hashes in one leaf, take the boundary nearest the middle */
+	if (!c->dh->dh_level) {
+		for (i = 0; i < n; i++) {
+			lo = mid - i;
+			hi = mid + i;
+			if (lo > 0 && numbfs_dx_ehash(c, lo) !=
+				      numbfs_dx_ehash(c, lo - 1))
+				break;
+			if (hi < n && numbfs_dx_ehash(c, hi) !=
+				      numbfs_dx_ehash(c, hi - 1)) {
+				lo = hi;
+				break;
+			}
+		}
+		if (i == n)
+			return -ENOSPC;
+		mid = lo;
+	}
+
+	err = numbfs_dx_new(dir, c->dh->dh_level, &s);
+	if (err)
+		return err;
+
+	sep = numbfs_dx_ehash(c, mid);
+	memcpy(s.de, &c->de[mid], (n - mid) * sizeof(*s.de));
+	s.dh->dh_entries = cpu_to_le16(n - mid);
+	c->dh->dh_entries = cpu_to_le16(mid);
+	numbfs_brw(&s.buf, NUMBFS_WRITE);
+	numbfs_brw(&c->buf, NUMBFS_WRITE);
+	numbfs_dx_insert(p, at + 1, sep, s.blk);
+
+	if (hash >= sep) {
+		numbfs_bput(&c->buf);
+		*c = s;
+	} else {
+		numbfs_bput(&s.buf);
+	}
+	return 0;
+}
+
+/* add the dirent @name at @pos to the index of @dir */
+int numbfs_dx_add(struct inode *dir, const char *name, int namelen, int pos)
+{
+	u32 hash = numbfs_dx_hash(name, namelen);
+	struct numbfs_dx_frame p, c;
+	int at, err;
+
+	err = numbfs_dx_read(dir, NUMBFS_I(dir)->dx_root, -1, &p);
+	if (err)
+		goto out;
+
+	if (numbfs_dx_count(&p) == NUMBFS_DX_ENTRIES) {
+		err = numbfs_dx_grow(dir, &p);
+		if (err)
+			goto out;
+	}
+
+	while (p.dh->dh_level) {
+		at = numbfs_dx_child(&p, hash);
+		err = numbfs_dx_read(dir, numbfs_dx_eptr(&p, at),
+				     p.dh->dh_level - 1, &c);
+		if (!err && numbfs_dx_count(&c) == NUMBFS_DX_ENTRIES)
+			err = numbfs_dx_split(dir, &p, at, &c, hash);
+		numbfs_bput(&p.buf);
+		p = c;
+		if (err)
+			goto out;
+	}
+	numbfs_dx_insert(&p, numbfs_dx_search(&p, hash, true), hash,
+			 numbfs_dx_ptr(dir, pos));
+out:
+	numbfs_bput(&p.buf);
+	return err;
+}
+
+/* find the entry of the dirent at @pos in the leaf for @hash */
+static int numbfs_dx_find(struct inode *dir, u32 hash, int pos,
+			  struct numbfs_dx_frame *f)
+{
+	int i, err, ptr = numbfs_dx_ptr(dir, pos);
+
+	err = numbfs_dx_leaf(dir, hash, f);
+	if (err)
+		return err;
+
+	for (i = numbfs_dx_search(f, hash, false);
+	     i < numbfs_dx_count(f) && numbfs_dx_ehash(f, i) == hash; i++) {
+		if (numbfs_dx_eptr(f, i) == ptr)
+			return i;
+	}
+
+	pr_err("numbfs: dirent@%d of directory@%lu is not indexed\n",
+	       pos, dir->i_ino);
+	return -EUCLEAN;
+}
+
+/* remove the dirent @name at @pos from the index of @dir */
+int numbfs_dx_delete(struct inode *dir, const char *name, int namelen,
+		     int pos)
+{
+	struct numbfs_dx_frame f;
+	int i;
+
+	i = numbfs_dx_find(dir, numbfs_dx_hash(name, namelen), pos, &f);
+	if (i >= 0)
+		numbfs_dx_remove(&f, i);
+	numbfs_bput(&f.buf);
+	return min(i, 0);
+}
+
+/* the dirent @name moved from @from to @to */
+int numbfs_dx_move(struct inode *dir, const char *name, int namelen,
+		   int from, int to)
+{
+	struct numbfs_dx_frame f;
+	int i;
+
+	i = numbfs_dx_find(dir, numbfs_dx_hash(name, namelen), from, &f);
+	if (i >= 0) {
+		f.de[i].de_ptr = cpu_to_le32(numbfs_dx_ptr(dir, to));
+		numbfs_brw(&f.buf, NUMBFS_WRITE);
+	}
+	numbfs_bput(&f.buf);
+	return min(i, 0);
+}
+
+/* free the index block @blk and its children, unless it is corrupted */
+static void numbfs_dx_free(struct inode *dir, int blk, int level)
+{
+	struct numbfs_dx_frame f;
+	int i;
+
+	if (!numbfs_dx_read(dir, blk, level, &f)) {
+		for (i = 0; f.dh->dh_level && i < numbfs_dx_count(&f); i++)
+			numbfs_dx_free(dir, numbfs_dx_eptr(&f, i),
+				       f.dh->dh_level - 1);
+		numbfs_bfree(dir->i_sb, blk);
+	}
+	numbfs_bput(&f.buf);
+}
+
+/* drop the index of @dir */
+void numbfs_dx_destroy(struct inode *dir)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+
+	if (ni->dx_root == NUMBFS_HOLE)
+		return;
+
+	numbfs_dx_free(dir, ni->dx_root, -1);
+	ni->dx_root = NUMBFS_HOLE;
+	mark_inode_dirty(dir);
+}
+
+/* index the dirents of @dir, which stays unindexed on failure */
+int numbfs_dx_build(struct inode *dir)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	struct numbfs_dx_frame root;
+	struct numbfs_dent d;
+	struct numbfs_buf buf;
+	loff_t pos;
+	int err;
+
+	err = numbfs_dx_new(dir, 0, &root);
+	if (err)
+		return err;
+	numbfs_brw(&root.buf, NUMBFS_WRITE);
+	numbfs_bput(&root.buf);
+	ni->dx_root = root.blk;
+
+	numbfs_ibuf_init(&buf, dir, 0);
+	for (pos = 0; pos < i_size_read(dir); pos += d.reclen) {
+		err = numbfs_dir_get(dir, pos, &buf, &d);
+		if (err)
+			break;
+
+		if (!d.namelen)
+			continue;
+		err = numbfs_dx_add(dir, d.name, d.namelen, pos);
+		if (err)
+			break;
+	}
+	numbfs_ibuf_put(&buf);
+
+	if (err)
+		numbfs_dx_destroy(dir);
+	else
+		mark_inode_dirty(dir);
+	return err;
+}
@@ -19,89 +19,193 @@ void numbfs_dir_set_ops(struct inode *inode)
 	inode->i_mapping->a_ops = &numbfs_aops;
 }
 
+/* the start of the directory block that holds @pos, in @buf's folio */
+static void *numbfs_dir_blk(struct numbfs_buf *buf, loff_t pos)
+{
+	loff_t off = (pos >> NUMBFS_BLOCK_BITS) << NUMBFS_BLOCK_BITS;
+
+	return (unsigned char*)buf->base + (off & (folio_size(buf->folio) - 1));
+}
+
+/* decode the dirent at @off of the directory block @blk */
+static int numbfs_dent_decode(struct inode *dir, void *blk, int off,
+			      struct numbfs_dent *d)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(dir->i_sb);
+	struct numbfs_cdirent *cde;
+	struct numbfs_dirent *de;
+
+	if (!numbfs_has_compact_dirent(sbi)) {
+		de = (struct numbfs_dirent*)((unsigned char*)blk + off);
+		d->name = de->name;
+		d->namelen = de->name_len;
+		d->ino = numbfs_dirent_ino(sbi, de);
+		d->type = de->type;
+		d->reclen = sizeof(*de);
+		return 0;
+	}
+
+	cde = (struct numbfs_cdirent*)((unsigned char*)blk + off);
+	if (off + sizeof(*cde) > NUMBFS_BYTES_PER_BLOCK)
+		goto corrupted;
+
+	d->reclen = le16_to_cpu(cde->de_rec_len);
+	if (d->reclen < NUMBFS_CDIRENT_LEN(cde->de_name_len) ||
+	    d->reclen & 3 || off + d->reclen > NUMBFS_BYTES_PER_BLOCK)
+		goto corrupted;
+
+	d->name = cde->de_name;
+	d->namelen = cde->de_name_len;
+	d->ino = le32_to_cpu(cde->de_ino);
+	d->type = cde->de_type;
+	return 0;
+corrupted:
+	pr_err("numbfs: invalid dirent@%d in a block of directory@%lu\n",
+	       off, dir->i_ino);
+	return -EUCLEAN;
+}
+
+/* read the dirent at @pos of @dir, @buf may already hold its block */
+int numbfs_dir_get(struct inode *dir, loff_t pos, struct numbfs_buf *buf,
+		   struct numbfs_dent *d)
+{
+	int err;
+
+	if (!buf->folio || buf->blkaddr != pos >> NUMBFS_BLOCK_BITS) {
+		numbfs_ibuf_put(buf);
+		numbfs_ibuf_init(buf, dir, pos >> NUMBFS_BLOCK_BITS);
+		err = numbfs_ibuf_read(buf);
+		if (err)
+			return err;
+	}
+	return numbfs_dent_decode(dir, numbfs_dir_blk(buf, pos),
+				  pos % NUMBFS_BYTES_PER_BLOCK, d);
+}
+
 /* find the target nid according to the name */
 static int numbfs_inode_by_name(struct inode *dir, const char *name,
 				int namelen, int *nid, int *offset)
 {
-	struct numbfs_dirent *de;
+	struct numbfs_dent d;
 	struct numbfs_buf buf;
-	int i, ret, err, off;
+	struct file_ra_state ra;
+	loff_t pos;
+	int ret, err;
 
-	ret = -ENOENT;
-	for (i = 0; i < dir->i_size; i += sizeof(*de)) {
-		if (i % NUMBFS_BYTES_PER_BLOCK == 0) {
-			if (i > 0)
-				numbfs_ibuf_put(&buf);
+	ret = numbfs_nc_lookup(dir, name, namelen, nid, offset);
+	if (ret != -EAGAIN)
+		return ret;
+
+	if (NUMBFS_I(dir)->dx_root != NUMBFS_HOLE)
+		return numbfs_dx_lookup(dir, name, namelen, nid, offset);
 
-			numbfs_ibuf_init(&buf, dir, i / NUMBFS_BYTES_PER_BLOCK);
-			err = numbfs_ibuf_read(&buf);
+	file_ra_state_init(&ra, dir->i_mapping);
+	numbfs_ibuf_init(&buf, dir, 0);
+	ret = -ENOENT;
+	/* dirents never cross a block */
+	for (pos = 0; pos < dir->i_size; pos += d.reclen) {
+		if (pos % NUMBFS_BYTES_PER_BLOCK == 0) {
+			numbfs_ibuf_put(&buf);
+			numbfs_ibuf_init(&buf, dir, pos / NUMBFS_BYTES_PER_BLOCK);
+			err = numbfs_ibuf_read_ra(&buf, &ra, NULL,
+					DIV_ROUND_UP(dir->i_size - pos, PAGE_SIZE));
 			if (err)
 				return err;
 		}
-		off = (i >> NUMBFS_BLOCK_BITS) << NUMBFS_BLOCK_BITS;
-		de = (struct numbfs_dirent*)((unsigned char*)buf.base +
-				(off & (folio_size(buf.folio) - 1)) +
-				(i % NUMBFS_BYTES_PER_BLOCK));
-		if (de->name_len == namelen &&
-		    !memcmp(name, de->name, namelen)) {
+
+		ret = numbfs_dent_decode(dir, numbfs_dir_blk(&buf, pos),
+					 pos % NUMBFS_BYTES_PER_BLOCK, &d);
+		if (ret)
+			break;
+
+		ret = -ENOENT;
+		if (d.namelen == namelen && !memcmp(name, d.name, namelen)) {
 			ret = 0;
-			*nid = le16_to_cpu(de->ino);
+			*nid = d.ino;
 			if (offset)
-				*offset = i;
+				*offset = pos;
 			break;
 		}
-
 	}
 
 	numbfs_ibuf_put(&buf);
 	return ret;
 }
 
+/*
+ * The first dirent at or after @pos in the block of @pos.  Compact dirents
+ * are merged on delete, so a position kept by readdir may now point into
+ * the middle of a dirent.
+ */
+static int numbfs_dir_revalidate(struct inode *dir, void *blk, loff_t pos,
+				 loff_t *next)
+{
+	struct numbfs_dent d;
+	int off, err;
+
+	for (off = 0; off < pos % NUMBFS_BYTES_PER_BLOCK; off += d.reclen) {
+		err = numbfs_dent_decode(dir, blk, off, &d);
+		if (err)
+			return err;
+	}
+	*next = pos - pos % NUMBFS_BYTES_PER_BLOCK + off;
+	return 0;
+}
+
 static int numbfs_readdir(struct file *file, struct dir_context *ctx)
 {
 	struct inode *dir = file_inode(file);
 	size_t dirsize = i_size_read(dir);
 	struct numbfs_buf buf;
-	struct numbfs_dirent *de;
-	int err, off;
+	struct numbfs_dent d;
+	int err = 0;
 
+	numbfs_ibuf_init(&buf, dir, 0);
 	while (ctx->pos < dirsize) {
-		const char *de_name;
-		unsigned int de_namelen;
-		unsigned char de_type;
-
-		if (ctx->pos % NUMBFS_BYTES_PER_BLOCK == 0) {
-			if (ctx->pos > 0)
-				numbfs_ibuf_put(&buf);
+		/* a new block, or resuming in the middle of one */
+		if (ctx->pos % NUMBFS_BYTES_PER_BLOCK == 0 || !buf.folio) {
+			numbfs_ibuf_put(&buf);
 			numbfs_ibuf_init(&buf, dir,
 					 ctx->pos / NUMBFS_BYTES_PER_BLOCK);
-			err = numbfs_ibuf_read(&buf);
+			err = numbfs_ibuf_read_ra(&buf, &file->f_ra, file,
+					DIV_ROUND_UP(dirsize - ctx->pos, PAGE_SIZE));
 			if (err) {
 				pr_info("numbfs: error to read dir block@%lld, err: %d\n", ctx->pos / NUMBFS_BYTES_PER_BLOCK, err);
 				goto out;
 			}
 
+			if (ctx->pos % NUMBFS_BYTES_PER_BLOCK &&
+			    numbfs_has_compact_dirent(NUMBFS_SB(dir->i_sb))) {
+				err = numbfs_dir_revalidate(dir,
+						numbfs_dir_blk(&buf, ctx->pos),
+						ctx->pos, &ctx->pos);
+				if (err)
+					goto out;
+				continue;
+			}
 		}
 
-		off = (ctx->pos >> NUMBFS_BLOCK_BITS) << NUMBFS_BLOCK_BITS;
-		de = (struct numbfs_dirent*)((unsigned char*)buf.base +
-				(off & (folio_size(buf.folio) - 1)) +
-				(ctx->pos % NUMBFS_BYTES_PER_BLOCK));
-		de_name = de->name;
-		de_namelen = de->name_len;
-		de_type = de->type;
-		ctx->pos += sizeof(struct numbfs_dirent);
-		if (!de_namelen) {
+		err = numbfs_dent_decode(dir, numbfs_dir_blk(&buf, ctx->pos),
+					 ctx->pos % NUMBFS_BYTES_PER_BLOCK, &d);
+		if (err)
+			goto out;
+
+		if (!d.namelen) {
+			if (numbfs_has_compact_dirent(NUMBFS_SB(dir->i_sb))) {
+				ctx->pos += d.reclen;
+				continue;
+			}
 			pr_err("numbfs: invalid dirent: namelen=0\n");
 			err = -EINVAL;
 			goto out;
 		}
 
-		if (!dir_emit(ctx, de_name, de_namelen, le16_to_cpu(de->ino),
-			      de_type)) {
+		/* only move on once the dirent is emitted */
+		if (!dir_emit(ctx, d.name, d.namelen, d.ino, d.type)) {
 			err = 0;
 			goto out;
 		}
+		ctx->pos += d.reclen;
 	}
 out:
 	numbfs_ibuf_put(&buf);
@@ -114,7 +218,7 @@ static struct dentry *numbfs_dir_lookup(struct inode *dir,
 	int res, ino;
 	struct inode *inode;
 
-	if (dentry->d_name.len > NUMBFS_MAX_PATH_LEN)
+	if (dentry->d_name.len > numbfs_max_namelen(NUMBFS_SB(dir->i_sb)))
 		return ERR_PTR(-ENAMETOOLONG);
 
 	res = numbfs_inode_by_name(dir, dentry->d_name.name,
@@ -162,15 +266,20 @@ static void numbfs_dir_init_inode(struct inode *inode, struct inode *dir,
 	ni->nid = nid;
 	for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
 		ni->data[i] = NUMBFS_HOLE;
+	if (numbfs_has_extent(sbi))
+		numbfs_ext_init(ni);
+	ni->dx_root = NUMBFS_HOLE;
 
+	/* place the inode's blocks in the same part of the disk as the inode */
 	blk = -1;
-	(void)numbfs_balloc(inode->i_sb, &blk);
+	(void)numbfs_balloc(inode->i_sb,
+			    (s64)nid * sbi->data_blocks / sbi->total_inodes, &blk);
 
-	/* zero out this block */
-	(void)numbfs_binit(&buf, inode->i_sb->s_bdev, numbfs_data_blk(sbi, blk));
-	(void)numbfs_brw(&buf, NUMBFS_READ);
-	memset(buf.base, 0, NUMBFS_BYTES_PER_BLOCK);
-	(void)numbfs_brw(&buf, NUMBFS_WRITE);
+	/* zero out this block, it is written back as a single block later */
+	if (!numbfs_binit(&buf, inode->i_sb->s_bdev, numbfs_data_blk(sbi, blk))) {
+		numbfs_bzero(&buf);
+		numbfs_bput(&buf);
+	}
 
 	ni->xattr_start = blk;
 }
@@ -181,7 +290,7 @@ static struct inode *numbfs_dir_ialloc(struct inode *dir, umode_t mode)
 	struct inode *inode;
 	int nid, err;
 
-	err = numbfs_ialloc(dir->i_sb, &nid);
+	err = numbfs_ialloc(dir, mode, &nid);
 	if (err)
 		return ERR_PTR(err);
 
@@ -202,13 +311,40 @@ static struct inode *numbfs_dir_ialloc(struct inode *dir, umode_t mode)
 	return inode;
 }
 
+/* drop a new inode whose dirent could not be added, eviction frees it */
+static void numbfs_dir_iabort(struct inode *inode)
+{
+	clear_nlink(inode);
+	discard_new_inode(inode);
+}
+
+/*
+ * Allocate the block that a dirent appended at @pos starts, writeback
+ * can't report a full filesystem to the caller.
+ */
+static int numbfs_dir_balloc(struct inode *dir, loff_t pos)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	struct numbfs_map map;
+
+	/* the direct blocks can't map beyond NUMBFS_NUM_DATA_ENTRY */
+	if (!numbfs_has_extent(ni->sbi) &&
+	    pos >= NUMBFS_NUM_DATA_ENTRY * NUMBFS_BYTES_PER_BLOCK)
+		return -ENOSPC;
+
+	map.m_lblk = pos >> NUMBFS_BLOCK_BITS;
+	map.m_len = 1;
+	return numbfs_iaddrspace_map(ni, &map, true);
+}
+
 /* position == 0: append a dirent */
-static int numbfs_write_dir(struct inode *dir, umode_t mode, const char *name,
+static int numbfs_write_fdir(struct inode *dir, umode_t mode, const char *name,
 			    int namelen, int nid, int position)
 {
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
 	struct folio *folio;
 	struct numbfs_dirent *de;
-	int size, off;
+	int size, off, err;
 	void *kaddr;
 
 	if (position)
@@ -220,19 +356,37 @@ static int numbfs_write_dir(struct inode *dir, umode_t mode, const char *name,
 	if (IS_ERR(folio))
 		return PTR_ERR(folio);
 
+	if (!position && !(size % NUMBFS_BYTES_PER_BLOCK)) {
+		err = numbfs_dir_balloc(dir, size);
+		if (err) {
+			folio_put(folio);
+			return err;
+		}
+	}
+
+	/* a rewritten dirent keeps its name, only appends change the index */
+	if (!position && ni->dx_root != NUMBFS_HOLE) {
+		err = numbfs_dx_add(dir, name, namelen, size);
+		if (err) {
+			folio_put(folio);
+			return err;
+		}
+	}
+
 	/* append a dirent in dir's address space */
 	folio_lock(folio);
 	kaddr = kmap_local_folio(folio, 0);
 	off = size & (folio_size(folio) - 1);
 	de = (struct numbfs_dirent*)((unsigned char*)kaddr + off);
-	de->ino = cpu_to_le16(nid);
 	memcpy(de->name, name, namelen);
+	numbfs_dirent_set_ino(ni->sbi, de, nid);
 	de->name_len = namelen;
 	de->type = fs_umode_to_dtype(mode);
 
 	iomap_dirty_folio(dir->i_mapping, folio);
 	folio_unlock(folio);
 	folio_release_kmap(folio, kaddr);
+	numbfs_nc_add(dir, name, namelen, nid, size);
 
 	/* update metadata */
 	if (!position) {
@@ -240,7 +394,152 @@ static int numbfs_write_dir(struct inode *dir, umode_t mode, const char *name,
 		mark_inode_dirty(dir);
 	}
 
-	return filemap_write_and_wait(dir->i_mapping);
+	return 0;
+}
+
+/*
+ * Compact dirents are packed into blocks and never cross one.  A dirent
+ * whose name_len is 0 is unused, it only happens at the start of a block
+ * since other freed dirents are merged into the one before them.
+ */
+static void numbfs_cdir_write(struct numbfs_buf *buf, loff_t pos, int reclen,
+			     const char *name, int namelen, int nid,
+			     umode_t mode)
+{
+	struct numbfs_cdirent *cde;
+
+	cde = (struct numbfs_cdirent*)((unsigned char*)numbfs_dir_blk(buf, pos) +
+				       pos % NUMBFS_BYTES_PER_BLOCK);
+	cde->de_ino = cpu_to_le32(nid);
+	cde->de_rec_len = cpu_to_le16(reclen);
+	cde->de_name_len = namelen;
+	cde->de_type = fs_umode_to_dtype(mode);
+	memcpy(cde->de_name, name, namelen);
+}
+
+static int numbfs_cdir_add(struct inode *dir, umode_t mode, const char *name,
+			   int namelen, int nid)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	int need = NUMBFS_CDIRENT_LEN(namelen);
+	int size = i_size_read(dir);
+	int nblks = size >> NUMBFS_BLOCK_BITS;
+	struct numbfs_cdirent *cde;
+	struct numbfs_buf buf;
+	struct numbfs_dent d;
+	loff_t pos, end;
+	int used, b, err;
+
+	numbfs_ibuf_init(&buf, dir, 0);
+	for (b = min(ni->dir_free, nblks); b < nblks; b++) {
+		pos = (loff_t)b << NUMBFS_BLOCK_BITS;
+		end = pos + NUMBFS_BYTES_PER_BLOCK;
+		for (; pos < end; pos += d.reclen) {
+			err = numbfs_dir_get(dir, pos, &buf, &d);
+			if (err)
+				goto out;
+
+			used = d.namelen ? NUMBFS_CDIRENT_LEN(d.namelen) : 0;
+			if (d.reclen - used >= need)
+				goto found;
+		}
+	}
+
+	/* no room, start a new block */
+	b = nblks;
+	pos = size;
+	used = 0;
+	d.reclen = NUMBFS_BYTES_PER_BLOCK;
+	numbfs_ibuf_put(&buf);
+	numbfs_ibuf_init(&buf, dir, b);
+	err = numbfs_ibuf_read(&buf);
+	if (!err)
+		err = numbfs_dir_balloc(dir, pos);
+	if (err)
+		goto out;
+found:
+	if (ni->dx_root != NUMBFS_HOLE) {
+		err = numbfs_dx_add(dir, name, namelen, pos + used);
+		if (err)
+			goto out;
+	}
+
+	folio_lock(buf.folio);
+	/* split the room off the dirent that had it */
+	if (used) {
+		cde = (struct numbfs_cdirent*)((unsigned char*)numbfs_dir_blk(&buf, pos) +
+					       pos % NUMBFS_BYTES_PER_BLOCK);
+		cde->de_rec_len = cpu_to_le16(used);
+	}
+	numbfs_cdir_write(&buf, pos + used, d.reclen - used, name, namelen,
+			  nid, mode);
+	iomap_dirty_folio(dir->i_mapping, buf.folio);
+	folio_unlock(buf.folio);
+	numbfs_nc_add(dir, name, namelen, nid, pos + used);
+
+	ni->dir_free = b;
+	if (b == nblks) {
+		numbfs_setsize(dir, size + NUMBFS_BYTES_PER_BLOCK);
+		mark_inode_dirty(dir);
+	}
+out:
+	numbfs_ibuf_put(&buf);
+	return err;
+}
+
+/* point the dirent at @pos to another inode, its name stays */
+static int numbfs_cdir_set(struct inode *dir, umode_t mode, int nid,
+			   loff_t pos)
+{
+	struct numbfs_cdirent *cde;
+	struct numbfs_buf buf;
+	struct numbfs_dent d;
+	int err;
+
+	numbfs_ibuf_init(&buf, dir, 0);
+	err = numbfs_dir_get(dir, pos, &buf, &d);
+	if (err)
+		goto out;
+
+	folio_lock(buf.folio);
+	cde = (struct numbfs_cdirent*)((unsigned char*)numbfs_dir_blk(&buf, pos) +
+				       pos % NUMBFS_BYTES_PER_BLOCK);
+	cde->de_ino = cpu_to_le32(nid);
+	cde->de_type = fs_umode_to_dtype(mode);
+	iomap_dirty_folio(dir->i_mapping, buf.folio);
+	folio_unlock(buf.folio);
+	numbfs_nc_add(dir, d.name, d.namelen, nid, pos);
+out:
+	numbfs_ibuf_put(&buf);
+	return err;
+}
+
+/* position == 0: add a dirent, otherwise rewrite the dirent at position */
+static int numbfs_write_dir(struct inode *dir, umode_t mode, const char *name,
+			    int namelen, int nid, int position)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	int err;
+
+	if (!numbfs_has_compact_dirent(ni->sbi))
+		err = numbfs_write_fdir(dir, mode, name, namelen, nid, position);
+	else if (position)
+		err = numbfs_cdir_set(dir, mode, nid, position);
+	else
+		err = numbfs_cdir_add(dir, mode, name, namelen, nid);
+	if (err)
+		return err;
+
+	/* index the directory once it outgrows its first block */
+	if (!position && ni->dx_root == NUMBFS_HOLE &&
+	    numbfs_has_dir_index(ni->sbi) &&
+	    i_size_read(dir) > NUMBFS_BYTES_PER_BLOCK) {
+		err = numbfs_dx_build(dir);
+		if (err)
+			pr_warn("numbfs: failed to index directory@%lu, err: %d\n",
+				dir->i_ino, err);
+	}
+	return 0;
 }
 
 static int numbfs_dir_create(struct mnt_idmap *idmap, struct inode *dir,
@@ -249,7 +548,7 @@ static int numbfs_dir_create(struct mnt_idmap *idmap, struct inode *dir,
 	struct inode *inode;
 	const char *name = dentry->d_name.name;
 	int namelen = dentry->d_name.len;
-	int nid;
+	int nid, err;
 
 	if (numbfs_inode_by_name(dir, dentry->d_name.name,
 			dentry->d_name.len,&nid, NULL) != -ENOENT)
@@ -260,11 +559,16 @@ static int numbfs_dir_create(struct mnt_idmap *idmap, struct inode *dir,
 	if (IS_ERR(inode))
 		return PTR_ERR(inode);
 
+	/* append a new dirent */
+	err = numbfs_write_dir(dir, mode, name, namelen, inode->i_ino, 0);
+	if (err) {
+		numbfs_dir_iabort(inode);
+		return err;
+	}
+
 	/* instantiate inode and entry */
 	d_instantiate_new(dentry, inode);
-
-	/* append a new dirent */
-	return numbfs_write_dir(dir, mode, name, namelen, inode->i_ino, 0);
+	return 0;
 }
 
 static int numbfs_make_empty(struct inode *dir, struct inode *pdir,
@@ -297,21 +601,25 @@ static int numbfs_dir_mkdir(struct mnt_idmap *idmap, struct inode *dir,
 	if (IS_ERR(inode))
 		return PTR_ERR(inode);
 
-	d_instantiate_new(dentry, inode);
-
 	err = numbfs_make_empty(inode, dir, mode, inode->i_ino);
-	if (err)
+	if (!err)
+		err = numbfs_write_dir(dir, mode, name, namelen, inode->i_ino,
+				       0);
+	if (err) {
+		numbfs_dir_iabort(inode);
 		return err;
+	}
 
-	return numbfs_write_dir(dir, mode, name, namelen, inode->i_ino, 0);
+	d_instantiate_new(dentry, inode);
+	return 0;
 }
 
-static int numbfs_delete_entry(struct inode *dir, int nid, int offset)
+static int numbfs_delete_fentry(struct inode *dir, int nid, int offset)
 {
 	struct folio *folio, *last_folio;
 	struct numbfs_dirent *de_from, *de_to;
 	void *kaddr_from, *kaddr_to;
-	int off_from, off_to;
+	int off_from, off_to, last, err = 0;
 	int size = i_size_read(dir);
 
 	folio = read_cache_folio(dir->i_mapping, offset >> PAGE_SHIFT,
@@ -319,18 +627,48 @@ static int numbfs_delete_entry(struct inode *dir, int nid, int offset)
 	if (IS_ERR(folio))
 		return PTR_ERR(folio);
 
-	last_folio = read_cache_folio(dir->i_mapping, size >> PAGE_SHIFT,
+	last = size - sizeof(*de_from);
+	last_folio = read_cache_folio(dir->i_mapping, last >> PAGE_SHIFT,
 				      NULL, NULL);
-	if (IS_ERR(last_folio))
+	if (IS_ERR(last_folio)) {
+		folio_put(folio);
 		return PTR_ERR(last_folio);
+	}
 
-	folio_lock(folio);
 	kaddr_to = kmap_local_folio(folio, 0);
 	kaddr_from = kmap_local_folio(last_folio, 0);
-	off_from = (size & (folio_size(last_folio) - 1)) - sizeof(*de_from);
+	off_from = last & (folio_size(last_folio) - 1);
 	off_to = (offset & (folio_size(folio) - 1));
 	de_from = (struct numbfs_dirent*)(kaddr_from + off_from);
 	de_to = (struct numbfs_dirent*)(kaddr_to + off_to);
+
+	/* the last dirent moves to the slot of the deleted one */
+	if (NUMBFS_I(dir)->dx_root != NUMBFS_HOLE) {
+		err = numbfs_dx_delete(dir, de_to->name, de_to->name_len,
+				       offset);
+		if (!err && de_from != de_to) {
+			err = numbfs_dx_move(dir, de_from->name,
+					de_from->name_len, last, offset);
+			/* the dirent stays, so must its index entry */
+			if (err && numbfs_dx_add(dir, de_to->name,
+						 de_to->name_len, offset))
+				pr_err("numbfs: failed to restore the index of directory@%lu\n",
+				       dir->i_ino);
+		}
+		if (err) {
+			folio_release_kmap(last_folio, kaddr_from);
+			folio_release_kmap(folio, kaddr_to);
+			return err;
+		}
+	}
+
+	numbfs_nc_delete(dir, de_to->name, de_to->name_len);
+	if (de_from != de_to)
+		numbfs_nc_add(dir, de_from->name, de_from->name_len,
+			      numbfs_dirent_ino(NUMBFS_SB(dir->i_sb), de_from),
+			      offset);
+
+	folio_lock(folio);
 	memcpy(de_to, de_from, sizeof(struct numbfs_dirent));
 
 	iomap_dirty_folio(dir->i_mapping, folio);
@@ -345,6 +683,67 @@ static int numbfs_delete_entry(struct inode *dir, int nid, int offset)
 	return 0;
 }
 
+/* merge the dirent at @offset into the one before it in its block */
+static int numbfs_delete_centry(struct inode *dir, int offset)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	loff_t pos = offset - offset % NUMBFS_BYTES_PER_BLOCK;
+	loff_t prev = -1;
+	struct numbfs_cdirent *cde;
+	struct numbfs_buf buf;
+	struct numbfs_dent d;
+	int err;
+
+	numbfs_ibuf_init(&buf, dir, 0);
+	for (; pos < offset; pos += d.reclen) {
+		err = numbfs_dir_get(dir, pos, &buf, &d);
+		if (err)
+			goto out;
+		prev = pos;
+	}
+
+	err = numbfs_dir_get(dir, offset, &buf, &d);
+	if (err)
+		goto out;
+	if (pos != offset || !d.namelen) {
+		err = -EUCLEAN;
+		goto out;
+	}
+
+	if (ni->dx_root != NUMBFS_HOLE) {
+		err = numbfs_dx_delete(dir, d.name, d.namelen, offset);
+		if (err)
+			goto out;
+	}
+
+	folio_lock(buf.folio);
+	if (prev >= 0) {
+		cde = (struct numbfs_cdirent*)((unsigned char*)numbfs_dir_blk(&buf, prev) +
+					       prev % NUMBFS_BYTES_PER_BLOCK);
+		le16_add_cpu(&cde->de_rec_len, d.reclen);
+	} else {
+		cde = (struct numbfs_cdirent*)((unsigned char*)numbfs_dir_blk(&buf, offset) +
+					       offset % NUMBFS_BYTES_PER_BLOCK);
+		cde->de_name_len = 0;
+	}
+	iomap_dirty_folio(dir->i_mapping, buf.folio);
+	folio_unlock(buf.folio);
+	numbfs_nc_delete(dir, d.name, d.namelen);
+
+	ni->dir_free = min_t(int, ni->dir_free, offset >> NUMBFS_BLOCK_BITS);
+	mark_inode_dirty(dir);
+out:
+	numbfs_ibuf_put(&buf);
+	return err;
+}
+
+static int numbfs_delete_entry(struct inode *dir, int nid, int offset)
+{
+	if (numbfs_has_compact_dirent(NUMBFS_SB(dir->i_sb)))
+		return numbfs_delete_centry(dir, offset);
+	return numbfs_delete_fentry(dir, nid, offset);
+}
+
 static int numbfs_dir_unlink(struct inode *dir, struct dentry *dentry)
 {
 	int nid, offset, err;
@@ -367,7 +766,25 @@ static int numbfs_dir_unlink(struct inode *dir, struct dentry *dentry)
 
 static bool numbfs_is_empty(struct inode *dir)
 {
+	struct numbfs_buf buf;
+	struct numbfs_dent d;
 	int err, nid, offset;
+	loff_t pos;
+
+	if (numbfs_has_compact_dirent(NUMBFS_SB(dir->i_sb))) {
+		numbfs_ibuf_init(&buf, dir, 0);
+		for (pos = 0; pos < i_size_read(dir); pos += d.reclen) {
+			err = numbfs_dir_get(dir, pos, &buf, &d);
+			if (err)
+				break;
+			/* only "." and ".." are left, their names are short */
+			if (d.namelen > DOTDOTLEN ||
+			    (d.namelen && memcmp(d.name, DOTDOT, d.namelen)))
+				break;
+		}
+		numbfs_ibuf_put(&buf);
+		return pos >= i_size_read(dir);
+	}
 
 	BUG_ON(i_size_read(dir) < 2 * sizeof(struct numbfs_dirent));
 
@@ -416,8 +833,8 @@ static int numbfs_dir_rename(struct mnt_idmap *idmap,
 {
 	struct inode *old_inode = d_inode(old_dentry);
 	struct inode *new_inode = d_inode(new_dentry);
-	struct numbfs_dirent de;
 	struct numbfs_buf buf;
+	struct numbfs_dent de;
 	int err, nid, offset;
 
 	/* delete the dirent in new_dir */
@@ -436,13 +853,11 @@ static int numbfs_dir_rename(struct mnt_idmap *idmap,
 	if (err)
 		return err;
 
-	numbfs_ibuf_init(&buf, old_dir, offset >> NUMBFS_BLOCK_BITS);
-	err = numbfs_ibuf_read(&buf);
+	numbfs_ibuf_init(&buf, old_dir, 0);
+	err = numbfs_dir_get(old_dir, offset, &buf, &de);
+	numbfs_ibuf_put(&buf);
 	if (err)
 		return err;
-	memcpy(&de, (char*)buf.base + (offset & (folio_size(buf.folio)- 1)),
-	       sizeof(struct numbfs_dirent));
-	numbfs_ibuf_put(&buf);
 
 	err = numbfs_delete_entry(old_dir, nid, offset);
 	if (err)
@@ -450,7 +865,7 @@ static int numbfs_dir_rename(struct mnt_idmap *idmap,
 
 	/* append the dirent in new_dir */
 	err = numbfs_write_dir(new_dir, old_inode->i_mode, new_dentry->d_name.name,
-			new_dentry->d_name.len, le16_to_cpu(de.ino), 0);
+			new_dentry->d_name.len, nid, 0);
 	if (err)
 		return err;
 
@@ -458,7 +873,7 @@ static int numbfs_dir_rename(struct mnt_idmap *idmap,
 	if (de.type == DT_DIR) {
 		struct inode *target;
 
-		target = numbfs_iget(old_inode->i_sb, le16_to_cpu(de.ino));
+		target = numbfs_iget(old_inode->i_sb, nid);
 		if (IS_ERR(target))
 			return PTR_ERR(target);
 
@@ -531,8 +946,10 @@ static int numbfs_dir_symlink(struct mnt_idmap *idmap, struct inode *dir,
 
 	/* copy symname */
 	folio = read_cache_folio(inode->i_mapping, 0, NULL, NULL);
-	if (IS_ERR(folio))
+	if (IS_ERR(folio)) {
+		numbfs_dir_iabort(inode);
 		return PTR_ERR(folio);
+	}
 
 	folio_lock(folio);
 	kaddr = kmap_local_folio(folio, 0);
@@ -544,12 +961,17 @@ static int numbfs_dir_symlink(struct mnt_idmap *idmap, struct inode *dir,
 	numbfs_setsize(inode, strlen(symname));
 	mark_inode_dirty(inode);
 
+	/* append dirent */
+	err = numbfs_write_dir(dir, S_IFLNK, dentry->d_name.name,
+			       dentry->d_name.len, inode->i_ino, 0);
+	if (err) {
+		numbfs_dir_iabort(inode);
+		return err;
+	}
+
 	/* instantiate inode and dentry */
 	d_instantiate_new(dentry, inode);
-
-	/* append dirent */
-	return numbfs_write_dir(dir, S_IFLNK, dentry->d_name.name,
-				dentry->d_name.len, inode->i_ino, 0);
+	return 0;
 }
 
 const struct inode_operations numbfs_dir_iops = {
@@ -567,4 +989,7 @@ const struct file_operations numbfs_dir_fops = {
 	.llseek         = generic_file_llseek,
 	.read           = generic_read_dir,
 	.iterate_shared = numbfs_readdir,
+	.fsync          = numbfs_fsync,
+	.unlocked_ioctl = numbfs_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
 };
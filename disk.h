@@ -10,8 +10,10 @@
  * It includes:
  * - Magic number and basic constants (block size, root inode, etc.)
  * - Superblock structure (filesystem metadata and bitmaps location)
- * - Inode structure (file metadata and data block pointers)
- * - Directory entry structure (file name and inode number mapping)
+ * - Inode structure (file metadata and data block pointers or extents)
+ * - Extent structures (extent-mapped files, NUMBFS_FEATURE_EXTENT)
+ * - Directory entry structures (file name and inode number mapping)
+ * - Directory index structures (hashed name lookup, NUMBFS_FEATURE_DIR_INDEX)
  * - Extended attribute entry structure (key-value storage)
  * - Compile-time checks for structure sizes
  *
@@ -41,6 +43,21 @@
 #define NUMBFS_MAX_PATH_LEN	60
 #define NUMBFS_MAX_ATTR 32
 
+/* feature bits of s_feature */
+#define NUMBFS_FEATURE_EXTENT	0x00000001	/* extent-mapped inodes */
+#define NUMBFS_FEATURE_DIR_INDEX	0x00000002	/* hashed directory index */
+#define NUMBFS_FEATURE_LARGE_INO	0x00000004	/* 32-bit inode numbers */
+#define NUMBFS_FEATURE_COMPACT_DIRENT	0x00000008	/* variable-length dirents */
+#define NUMBFS_FEATURE_ALL	(NUMBFS_FEATURE_EXTENT | NUMBFS_FEATURE_DIR_INDEX | \
+				 NUMBFS_FEATURE_LARGE_INO | \
+				 NUMBFS_FEATURE_COMPACT_DIRENT)
+
+/* without NUMBFS_FEATURE_LARGE_INO, inode numbers are 16-bit */
+#define NUMBFS_MAX_INODES	(1 << 16)
+
+/* i_size is 32-bit on disk */
+#define NUMBFS_EXTENT_MAXBYTES	0xFFFFFFFFLL
+
 /* 128-byte on-disk numbfs superblock, 64 bytes should be enough, but... */
 struct numbfs_super_block {
 	__le32 s_magic;
@@ -66,6 +83,24 @@ struct numbfs_super_block {
 	__u8 s_reserved[88];
 };
 
+/* 12-byte on-disk extent, maps e_len blocks from e_lblk to e_pblk */
+struct numbfs_extent {
+	/* first logical block */
+	__le32 e_lblk;
+	/* first data block */
+	__le32 e_pblk;
+	/* number of blocks, and NUMBFS_EXT_UNWRITTEN */
+	__le32 e_len;
+};
+
+/* the blocks are allocated, but read as zeroes until written */
+#define NUMBFS_EXT_UNWRITTEN	0x80000000
+
+#define NUMBFS_INLINE_EXTENTS	3
+
+/* i_flags */
+#define NUMBFS_IFLAG_DX		0x01	/* directory with an index, see t_dx_root */
+
 /* 64-byte on-disk numbfs inode */
 struct numbfs_inode {
 	__le16 i_ino;
@@ -78,26 +113,131 @@ struct numbfs_inode {
 	__le32 i_xattr_start;
 	/* number of xattrs */
 	__u8 i_xattr_count;
-	__u8 reserved2[3]; /* padding */
-	/* block addr of data blocks */
-	__le32 i_data[10];
+	/* NUMBFS_IFLAG_* */
+	__u8 i_flags;
+	/* NUMBFS_FEATURE_LARGE_INO: high 16 bits of i_ino */
+	__le16 i_ino_hi;
+	union {
+		/* block addr of data blocks */
+		__le32 i_data[10];
+		/*
+		 * NUMBFS_FEATURE_EXTENT: extents sorted by e_lblk, unused
+		 * extents have e_len == 0.  Once the inline extents are full,
+		 * the following extents go to the extent tree.
+		 */
+		struct {
+			/* block addr of the extent tree root, or NUMBFS_HOLE */
+			__le32 i_extent_blk;
+			struct numbfs_extent i_extents[NUMBFS_INLINE_EXTENTS];
+		};
+	};
+};
+
+#define NUMBFS_EXTENT_MAGIC	0x4E455854 /* "NEXT" */
+
+/* 12-byte header of an extent tree block, followed by the entries */
+struct numbfs_extent_header {
+	__le32 eh_magic;
+	/* number of valid entries in this block */
+	__le16 eh_entries;
+	/* 0 for leaves, the root has the highest level */
+	__u8 eh_level;
+	__u8 eh_reserved;
+	__le32 eh_reserved2;
+};
+
+/*
+ * 8-byte entry of an interior extent tree block, entries are sorted by
+ * ei_lblk.  ei_blk is the block addr of a child that maps the extents
+ * from ei_lblk up to the ei_lblk of the next entry.  The leaves hold
+ * struct numbfs_extent entries.
+ */
+struct numbfs_extent_idx {
+	__le32 ei_lblk;
+	__le32 ei_blk;
 };
 
+#define NUMBFS_BLOCK_EXTENTS \
+	((NUMBFS_BYTES_PER_BLOCK - sizeof(struct numbfs_extent_header)) / sizeof(struct numbfs_extent))
+#define NUMBFS_BLOCK_EXTENT_IDX \
+	((NUMBFS_BYTES_PER_BLOCK - sizeof(struct numbfs_extent_header)) / sizeof(struct numbfs_extent_idx))
+/* enough for one extent per block of a NUMBFS_EXTENT_MAXBYTES file */
+#define NUMBFS_EXT_MAX_LEVEL	3
+
+/* NUMBFS_FEATURE_LARGE_INO: names are shorter, to make room for de_ino_hi */
+#define NUMBFS_LARGE_INO_PATH_LEN	(NUMBFS_MAX_PATH_LEN - 2)
+
 /* 64-byte on-disk numbfs dirent */
 struct numbfs_dirent {
 	__u8 name_len;
 	__u8 type;
-	char name[NUMBFS_MAX_PATH_LEN];
+	union {
+		char name[NUMBFS_MAX_PATH_LEN];
+		struct {
+			char name_large_ino[NUMBFS_LARGE_INO_PATH_LEN];
+			/* NUMBFS_FEATURE_LARGE_INO: high 16 bits of ino */
+			__le16 ino_hi;
+		};
+	};
 	__le16 ino;
 };
 
+/*
+ * NUMBFS_FEATURE_COMPACT_DIRENT: variable-length on-disk dirent, replaces
+ * struct numbfs_dirent.  Dirents are 4-byte aligned and never cross a
+ * block, the de_rec_len of the last dirent of a block reaches the end of
+ * the block.  A dirent with de_name_len == 0 is unused.
+ */
+struct numbfs_cdirent {
+	__le32 de_ino;
+	/* bytes to the next dirent */
+	__le16 de_rec_len;
+	__u8 de_name_len;
+	__u8 de_type;
+	char de_name[];
+};
+
+#define NUMBFS_CDIRENT_MAX_NAME		255
+#define NUMBFS_CDIRENT_LEN(name_len) \
+	((sizeof(struct numbfs_cdirent) + (name_len) + 3) & ~3)
+
 struct numbfs_timestamps {
 	__le64 t_atime;
 	__le64 t_mtime;
 	__le64 t_ctime;
-	__u8 reserved[8];
+	/* NUMBFS_IFLAG_DX: block addr of the root of the directory index */
+	__le32 t_dx_root;
+	__u8 reserved[4];
 };
 
+#define NUMBFS_DX_MAGIC		0x4E445849 /* "NDXI" */
+
+/* 8-byte header of a directory index block, followed by the entries */
+struct numbfs_dx_header {
+	__le32 dh_magic;
+	/* number of valid entries in this block */
+	__le16 dh_entries;
+	/* 0 for leaves, the root has the highest level */
+	__u8 dh_level;
+	__u8 dh_reserved;
+};
+
+/*
+ * 8-byte directory index entry, entries are sorted by de_hash.  In a leaf,
+ * de_ptr is the slot of a dirent whose name hashes to de_hash, or its byte
+ * offset with NUMBFS_FEATURE_COMPACT_DIRENT.  Otherwise
+ * de_ptr is the block addr of a child that holds the hashes from de_hash
+ * up to the de_hash of the next entry.
+ */
+struct numbfs_dx_entry {
+	__le32 de_hash;
+	__le32 de_ptr;
+};
+
+#define NUMBFS_DX_ENTRIES \
+	((NUMBFS_BYTES_PER_BLOCK - sizeof(struct numbfs_dx_header)) / sizeof(struct numbfs_dx_entry))
+#define NUMBFS_DX_MAX_LEVEL	3
+
 /* xattr name indexes */
 #define NUMBFS_XATTR_INDEX_USER              1
 #define NUMBFS_XATTR_INDEX_TRUSTED           2
@@ -126,7 +266,13 @@ static inline void numbfs_check_ondisk(void)
 	BUILD_BUG_ON(sizeof(struct numbfs_super_block) != 128);
 	BUILD_BUG_ON(sizeof(struct numbfs_inode) != 64);
 	BUILD_BUG_ON(sizeof(struct numbfs_dirent) != 64);
+	BUILD_BUG_ON(sizeof(struct numbfs_cdirent) != 8);
 	BUILD_BUG_ON(sizeof(struct numbfs_timestamps) != 32);
+	BUILD_BUG_ON(sizeof(struct numbfs_extent) != 12);
+	BUILD_BUG_ON(sizeof(struct numbfs_extent_header) != 12);
+	BUILD_BUG_ON(sizeof(struct numbfs_extent_idx) != 8);
+	BUILD_BUG_ON(sizeof(struct numbfs_dx_header) != 8);
+	BUILD_BUG_ON(sizeof(struct numbfs_dx_entry) != 8);
 }
 
 #endif
@@ -0,0 +1,773 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+/*
+ * numbfs extent-mapped inodes (NUMBFS_FEATURE_EXTENT)
+ *
+ * The first NUMBFS_INLINE_EXTENTS extents live in the on-disk inode, the
+ * following ones in an extent tree rooted at i_extent_blk.  In memory, all
+ * the extents of an inode are kept in one array sorted by logical block,
+ * which is protected by ni->map_sem.  Blocks preallocated by fallocate are
+ * kept in unwritten extents until data is written to them.
+ *
+ * The tree is kept packed: every leaf but the last one holds
+ * NUMBFS_BLOCK_EXTENTS extents, and every interior block but the last one
+ * of its level holds NUMBFS_BLOCK_EXTENT_IDX children, up to a single root.
+ * So the shape of the tree follows from the number of extents, and a
+ * change to the extent array only rewrites the leaves from the first
+ * changed extent on and the interior blocks above them.  ni->ext_tree holds
+ * the tree block addrs level by level, from the first leaf to the root.
+ * The blocks are allocated before the extents that need them are inserted,
+ * so that inserting an extent can not fail halfway.
+ */
+
+#include "internal.h"
+
+static void numbfs_ext_decode(struct numbfs_iext *ie,
+			      struct numbfs_extent *de)
+{
+	ie->lblk = le32_to_cpu(de->e_lblk);
+	ie->pblk = le32_to_cpu(de->e_pblk);
+	ie->len = le32_to_cpu(de->e_len) & ~NUMBFS_EXT_UNWRITTEN;
+	ie->unwritten = le32_to_cpu(de->e_len) & NUMBFS_EXT_UNWRITTEN;
+}
+
+static void numbfs_ext_encode(struct numbfs_extent *de,
+			      struct numbfs_iext *ie)
+{
+	de->e_lblk = cpu_to_le32(ie->lblk);
+	de->e_pblk = cpu_to_le32(ie->pblk);
+	de->e_len = cpu_to_le32(ie->len |
+				(ie->unwritten ? NUMBFS_EXT_UNWRITTEN : 0));
+}
+
+void numbfs_ext_init(struct numbfs_inode_info *ni)
+{
+	ni->ext = ni->ext_inline;
+	ni->nr_ext = 0;
+	ni->ext_cap = NUMBFS_INLINE_EXTENTS;
+	ni->ext_tree = NULL;
+	ni->nr_tree = 0;
+	ni->tree_cap = 0;
+	ni->ext_dirty = INT_MAX;
+	ni->ext_reshaped = false;
+}
+
+void numbfs_ext_destroy(struct numbfs_inode_info *ni)
+{
+	if (ni->ext != ni->ext_inline)
+		kvfree(ni->ext);
+	ni->ext = NULL;
+	kvfree(ni->ext_tree);
+	ni->ext_tree = NULL;
+}
+
+/*
+ * Number of tree blocks of each level that @nr extents need, returns the
+ * number of levels.
+ */
+static int numbfs_ext_shape(int nr, int *nodes)
+{
+	int level = 0;
+
+	nr -= NUMBFS_INLINE_EXTENTS;
+	if (nr <= 0)
+		return 0;
+
+	nodes[0] = DIV_ROUND_UP(nr, NUMBFS_BLOCK_EXTENTS);
+	while (nodes[level] > 1) {
+		if (level == NUMBFS_EXT_MAX_LEVEL)
+			return -EFBIG;
+		nodes[level + 1] = DIV_ROUND_UP(nodes[level],
+						NUMBFS_BLOCK_EXTENT_IDX);
+		level++;
+	}
+	return level + 1;
+}
+
+/* number of tree blocks that @nr extents need */
+static int numbfs_ext_tree_size(int nr)
+{
+	int nodes[NUMBFS_EXT_MAX_LEVEL + 1];
+	int levels = numbfs_ext_shape(nr, nodes), size = 0;
+
+	if (levels < 0)
+		return levels;
+	while (levels--)
+		size += nodes[levels];
+	return size;
+}
+
+static int numbfs_ext_root(struct numbfs_inode_info *ni)
+{
+	int size = numbfs_ext_tree_size(ni->nr_ext);
+
+	return size > 0 ? ni->ext_tree[size - 1] : NUMBFS_HOLE;
+}
+
+/* index of the first extent below the block @idx of @level */
+static int numbfs_ext_node_first(int level, int idx)
+{
+	while (level--)
+		idx *= NUMBFS_BLOCK_EXTENT_IDX;
+	return NUMBFS_INLINE_EXTENTS + idx * NUMBFS_BLOCK_EXTENTS;
+}
+
+/* the extents from @idx on changed, their leaves need to be rewritten */
+static void numbfs_ext_touch(struct numbfs_inode_info *ni, int idx)
+{
+	ni->ext_dirty = min(ni->ext_dirty, max(idx, 0));
+}
+
+/* make room for @nr extents in the extent array */
+static int numbfs_ext_grow(struct numbfs_inode_info *ni, int nr)
+{
+	struct numbfs_iext *ext;
+	int cap;
+
+	if (nr <= ni->ext_cap)
+		return 0;
+
+	cap = max3(nr, 2 * ni->ext_cap,
+		   NUMBFS_INLINE_EXTENTS + NUMBFS_BLOCK_EXTENTS);
+	ext = kvmalloc_array(cap, sizeof(*ext), GFP_NOFS);
+	if (!ext)
+		return -ENOMEM;
+
+	memcpy(ext, ni->ext, ni->nr_ext * sizeof(*ext));
+	if (ni->ext != ni->ext_inline)
+		kvfree(ni->ext);
+	ni->ext = ext;
+	ni->ext_cap = cap;
+	return 0;
+}
+
+/* make room for @nr block addrs in ni->ext_tree */
+static int numbfs_ext_tree_grow(struct numbfs_inode_info *ni, int nr)
+{
+	int *tree, cap;
+
+	if (nr <= ni->tree_cap)
+		return 0;
+
+	cap = max3(nr, 2 * ni->tree_cap, 4);
+	tree = kvmalloc_array(cap, sizeof(*tree), GFP_NOFS);
+	if (!tree)
+		return -ENOMEM;
+
+	if (ni->nr_tree)
+		memcpy(tree, ni->ext_tree, ni->nr_tree * sizeof(*tree));
+	kvfree(ni->ext_tree);
+	ni->ext_tree = tree;
+	ni->tree_cap = cap;
+	return 0;
+}
+
+/*
+ * Read the tree block @blk, which should be at @level, or at any level if
+ * @level is negative.  Returns the number of entries, and the block in @buf.
+ */
+static int numbfs_ext_read_node(struct numbfs_inode_info *ni,
+				struct numbfs_buf *buf, int blk, int level)
+{
+	struct super_block *sb = ni->vfs_inode.i_sb;
+	struct numbfs_extent_header *eh;
+	int entries, max, err;
+
+	err = numbfs_binit(buf, sb->s_bdev, numbfs_data_blk(ni->sbi, blk));
+	if (err)
+		return err;
+
+	err = numbfs_brw(buf, NUMBFS_READ);
+	if (err)
+		goto out;
+
+	eh = (struct numbfs_extent_header*)buf->base;
+	entries = le16_to_cpu(eh->eh_entries);
+	if (level < 0)
+		level = eh->eh_level;
+	max = level ? NUMBFS_BLOCK_EXTENT_IDX : NUMBFS_BLOCK_EXTENTS;
+	if (le32_to_cpu(eh->eh_magic) == NUMBFS_EXTENT_MAGIC &&
+	    eh->eh_level == level && level <= NUMBFS_EXT_MAX_LEVEL &&
+	    entries && entries <= max)
+		return entries;
+
+	pr_err("numbfs: invalid extent tree block@%d of inode@%d\n",
+	       blk, ni->nid);
+	err = -EUCLEAN;
+out:
+	numbfs_bput(buf);
+	return err;
+}
+
+/*
+ * Read the extent tree level by level, from the root down to the leaves.
+ * The tree must be packed, see above.
+ */
+static int numbfs_ext_load_tree(struct numbfs_inode_info *ni, int root)
+{
+	int *blks[NUMBFS_EXT_MAX_LEVEL + 1] = {};
+	int nr[NUMBFS_EXT_MAX_LEVEL + 1] = {};
+	struct numbfs_extent_header *eh;
+	struct numbfs_extent_idx *ei;
+	struct numbfs_extent *de;
+	struct numbfs_buf buf;
+	int height, level, i, j, full, entries, size = 0, err;
+
+	entries = numbfs_ext_read_node(ni, &buf, root, -1);
+	if (entries < 0)
+		return entries;
+	height = ((struct numbfs_extent_header*)buf.base)->eh_level;
+	numbfs_bput(&buf);
+
+	err = -ENOMEM;
+	blks[height] = kvmalloc_array(1, sizeof(int), GFP_NOFS);
+	if (!blks[height])
+		goto out;
+	blks[height][nr[height]++] = root;
+
+	for (level = height; level >= 0; level--) {
+		full = level ? NUMBFS_BLOCK_EXTENT_IDX : NUMBFS_BLOCK_EXTENTS;
+		if (level) {
+			blks[level - 1] = kvmalloc_array(nr[level] * full,
+							 sizeof(int), GFP_NOFS);
+			err = -ENOMEM;
+			if (!blks[level - 1])
+				goto out;
+		}
+
+		for (i = 0; i < nr[level]; i++) {
+			entries = numbfs_ext_read_node(ni, &buf, blks[level][i],
+						       level);
+			err = entries;
+			if (entries < 0)
+				goto out;
+
+			err = -EUCLEAN;
+			if ((i < nr[level] - 1 && entries != full) ||
+			    (level && level == height && entries < 2)) {
+				pr_err("numbfs: extent tree of inode@%d is not packed\n",
+				       ni->nid);
+				goto put;
+			}
+
+			eh = (struct numbfs_extent_header*)buf.base;
+			if (level) {
+				ei = (struct numbfs_extent_idx*)(eh + 1);
+				for (j = 0; j < entries; j++)
+					blks[level - 1][nr[level - 1]++] =
+						le32_to_cpu(ei[j].ei_blk);
+			} else {
+				err = numbfs_ext_grow(ni, ni->nr_ext + entries);
+				if (err)
+					goto put;
+
+				de = (struct numbfs_extent*)(eh + 1);
+				for (j = 0; j < entries; j++)
+					numbfs_ext_decode(&ni->ext[ni->nr_ext++],
+							  &de[j]);
+			}
+			numbfs_bput(&buf);
+		}
+		size += nr[level];
+	}
+
+	/* the leaves first, the root last */
+	err = numbfs_ext_tree_grow(ni, size);
+	if (err)
+		goto out;
+	for (level = 0; level <= height; level++)
+		for (i = 0; i < nr[level]; i++)
+			ni->ext_tree[ni->nr_tree++] = blks[level][i];
+	goto out;
+put:
+	numbfs_bput(&buf);
+out:
+	for (level = 0; level <= height; level++)
+		kvfree(blks[level]);
+	return err;
+}
+
+/* load the extents of an inode from its on-disk copy */
+int numbfs_ext_load(struct numbfs_inode_info *ni, struct numbfs_inode *di)
+{
+	int i, root;
+
+	numbfs_ext_init(ni);
+	for (i = 0; i < NUMBFS_INLINE_EXTENTS; i++) {
+		if (!di->i_extents[i].e_len)
+			break;
+		numbfs_ext_decode(&ni->ext[ni->nr_ext++], &di->i_extents[i]);
+	}
+
+	root = (int)le32_to_cpu(di->i_extent_blk);
+	if (root == NUMBFS_HOLE)
+		return 0;
+
+	if (ni->nr_ext < NUMBFS_INLINE_EXTENTS) {
+		pr_err("numbfs: inode@%d has an extent tree but free inline extents\n",
+		       ni->nid);
+		return -EUCLEAN;
+	}
+	return numbfs_ext_load_tree(ni, root);
+}
+
+/* start rebuilding the tree block @blk, returns its first entry */
+static void *numbfs_ext_node_start(struct numbfs_inode_info *ni,
+				   struct numbfs_buf *buf, int blk, int level,
+				   int entries)
+{
+	struct super_block *sb = ni->vfs_inode.i_sb;
+	struct numbfs_extent_header *eh;
+	int err;
+
+	err = numbfs_binit(buf, sb->s_bdev, numbfs_data_blk(ni->sbi, blk));
+	if (err)
+		return ERR_PTR(err);
+
+	/* the block is rebuilt from scratch, don't read it */
+	lock_buffer(buf->bh);
+	memset(buf->base, 0, NUMBFS_BYTES_PER_BLOCK);
+	eh = (struct numbfs_extent_header*)buf->base;
+	eh->eh_magic = cpu_to_le32(NUMBFS_EXTENT_MAGIC);
+	eh->eh_entries = cpu_to_le16(entries);
+	eh->eh_level = level;
+	return eh + 1;
+}
+
+static int numbfs_ext_node_write(struct numbfs_buf *buf)
+{
+	int err;
+
+	set_buffer_uptodate(buf->bh);
+	unlock_buffer(buf->bh);
+	err = numbfs_brw(buf, NUMBFS_WRITE);
+	numbfs_bput(buf);
+	return err;
+}
+
+static int numbfs_ext_dump_tree(struct numbfs_inode_info *ni)
+{
+	int nodes[NUMBFS_EXT_MAX_LEVEL + 1];
+	struct numbfs_extent_idx *ei;
+	struct numbfs_extent *de;
+	struct numbfs_buf buf;
+	int levels, level, first, i, j, n, pos = 0, err;
+
+	levels = numbfs_ext_shape(ni->nr_ext, nodes);
+
+	/* the leaves before the one of the first changed extent are intact */
+	first = max(ni->ext_dirty - NUMBFS_INLINE_EXTENTS, 0) /
+		NUMBFS_BLOCK_EXTENTS;
+	first = min(first, nodes[0] - 1);
+
+	for (level = 0; level < levels; level++) {
+		/* a new shape moves the interior blocks around */
+		if (level && ni->ext_reshaped)
+			first = 0;
+
+		for (i = first; i < nodes[level]; i++) {
+			if (!level) {
+				j = numbfs_ext_node_first(0, i);
+				n = min_t(int, ni->nr_ext - j,
+					  NUMBFS_BLOCK_EXTENTS);
+				de = numbfs_ext_node_start(ni, &buf,
+							   ni->ext_tree[i], 0, n);
+				if (IS_ERR(de))
+					return PTR_ERR(de);
+				while (n--)
+					numbfs_ext_encode(de++, &ni->ext[j++]);
+			} else {
+				j = i * NUMBFS_BLOCK_EXTENT_IDX;
+				n = min_t(int, nodes[level - 1] - j,
+					  NUMBFS_BLOCK_EXTENT_IDX);
+				ei = numbfs_ext_node_start(ni, &buf,
+							   ni->ext_tree[pos + i],
+							   level, n);
+				if (IS_ERR(ei))
+					return PTR_ERR(ei);
+				for (; n--; ei++, j++) {
+					ei->ei_lblk = cpu_to_le32(ni->ext[
+						numbfs_ext_node_first(level - 1, j)].lblk);
+					ei->ei_blk = cpu_to_le32(
+						ni->ext_tree[pos - nodes[level - 1] + j]);
+				}
+			}
+
+			err = numbfs_ext_node_write(&buf);
+			if (err)
+				return err;
+		}
+		pos += nodes[level];
+		first /= NUMBFS_BLOCK_EXTENT_IDX;
+	}
+	return 0;
+}
+
+/* write the extents of an inode to its on-disk copy */
+int numbfs_ext_dump(struct numbfs_inode_info *ni, struct numbfs_inode *di)
+{
+	int i, root, err = 0;
+
+	down_read(&ni->map_sem);
+	root = numbfs_ext_root(ni);
+	di->i_extent_blk = cpu_to_le32(root);
+	for (i = 0; i < NUMBFS_INLINE_EXTENTS; i++) {
+		if (i < ni->nr_ext)
+			numbfs_ext_encode(&di->i_extents[i], &ni->ext[i]);
+		else
+			memset(&di->i_extents[i], 0, sizeof(di->i_extents[i]));
+	}
+
+	if (root != NUMBFS_HOLE &&
+	    (ni->ext_dirty != INT_MAX || ni->ext_reshaped))
+		err = numbfs_ext_dump_tree(ni);
+	/* map_sem writers are excluded, and inode writeback is serialized */
+	if (!err) {
+		ni->ext_dirty = INT_MAX;
+		ni->ext_reshaped = false;
+	}
+	up_read(&ni->map_sem);
+	return err;
+}
+
+/* return the index of the last extent starting at or before @lblk, or -1 */
+static int numbfs_ext_lookup(struct numbfs_inode_info *ni, int lblk)
+{
+	int lo = 0, hi = ni->nr_ext - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ni->ext[mid].lblk <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+static bool numbfs_ext_mergeable(struct numbfs_iext *left,
+				 struct numbfs_iext *right)
+{
+	return left->lblk + left->len == right->lblk &&
+	       left->pblk + left->len == right->pblk &&
+	       left->unwritten == right->unwritten;
+}
+
+/* remove the extent at @idx */
+static void numbfs_ext_remove(struct numbfs_inode_info *ni, int idx)
+{
+	numbfs_ext_touch(ni, idx);
+	memmove(&ni->ext[idx], &ni->ext[idx + 1],
+		(ni->nr_ext - idx - 1) * sizeof(*ni->ext));
+	ni->nr_ext--;
+}
+
+/* free the tree blocks that the extents no longer need */
+static void numbfs_ext_shrink(struct numbfs_inode_info *ni)
+{
+	int size = numbfs_ext_tree_size(ni->nr_ext);
+
+	while (ni->nr_tree > size) {
+		numbfs_bfree(ni->vfs_inode.i_sb, ni->ext_tree[--ni->nr_tree]);
+		ni->ext_reshaped = true;
+	}
+}
+
+/* allocate the tree blocks that @nr extents need */
+static int numbfs_ext_tree_reserve(struct numbfs_inode_info *ni, int nr)
+{
+	struct super_block *sb = ni->vfs_inode.i_sb;
+	int size = numbfs_ext_tree_size(nr), goal, err;
+
+	if (size <= ni->nr_tree)
+		return min(size, 0);
+
+	err = numbfs_ext_tree_grow(ni, size);
+	if (err)
+		return err;
+
+	while (ni->nr_tree < size) {
+		goal = ni->nr_tree ? ni->ext_tree[ni->nr_tree - 1] :
+				     ni->xattr_start;
+		err = numbfs_balloc(sb, goal, &ni->ext_tree[ni->nr_tree]);
+		if (err)
+			return err;
+		ni->nr_tree++;
+		ni->ext_reshaped = true;
+	}
+	return 0;
+}
+
+/* make room for @nr more extents, so that inserting them can't fail */
+static int numbfs_ext_reserve(struct numbfs_inode_info *ni, int nr)
+{
+	int err;
+
+	if (nr <= 0)
+		return 0;
+
+	err = numbfs_ext_grow(ni, ni->nr_ext + nr);
+	if (!err)
+		err = numbfs_ext_tree_reserve(ni, ni->nr_ext + nr);
+	if (err)
+		numbfs_ext_shrink(ni);
+	return err;
+}
+
+/* insert @new after the extent at @idx, merging with its neighbours */
+static int numbfs_ext_insert(struct numbfs_inode_info *ni, int idx,
+			     struct numbfs_iext *new)
+{
+	struct numbfs_iext *left, *right;
+	int err;
+
+	numbfs_ext_touch(ni, idx);
+	left = idx >= 0 ? &ni->ext[idx] : NULL;
+	right = idx + 1 < ni->nr_ext ? &ni->ext[idx + 1] : NULL;
+
+	if (left && numbfs_ext_mergeable(left, new)) {
+		left->len += new->len;
+		if (right && numbfs_ext_mergeable(left, right)) {
+			left->len += right->len;
+			numbfs_ext_remove(ni, idx + 1);
+			numbfs_ext_shrink(ni);
+		}
+		return 0;
+	}
+
+	if (right && numbfs_ext_mergeable(new, right)) {
+		right->lblk = new->lblk;
+		right->pblk = new->pblk;
+		right->len += new->len;
+		return 0;
+	}
+
+	err = numbfs_ext_reserve(ni, 1);
+	if (err)
+		return err;
+
+	memmove(&ni->ext[idx + 2], &ni->ext[idx + 1],
+		(ni->nr_ext - idx - 1) * sizeof(*ni->ext));
+	ni->ext[idx + 1] = *new;
+	ni->nr_ext++;
+	return 0;
+}
+
+/* allocate the first blocks of the hole described by @map */
+static int numbfs_ext_alloc(struct numbfs_inode_info *ni,
+			    struct numbfs_map *map, int idx, bool unwritten)
+{
+	struct super_block *sb = ni->vfs_inode.i_sb;
+	struct numbfs_iext new;
+	int blk, len = map->m_len, err;
+
+	err = numbfs_data_balloc(ni, map->m_lblk, &blk, &len);
+	if (err)
+		return err;
+
+	new.lblk = map->m_lblk;
+	new.pblk = blk;
+	new.len = len;
+	new.unwritten = unwritten;
+	err = numbfs_ext_insert(ni, idx, &new);
+	if (err) {
+		numbfs_bfree_range(sb, blk, len);
+		return err;
+	}
+
+	map->m_pblk = blk;
+	map->m_len = len;
+	map->m_flags |= NUMBFS_MAP_NEW;
+	if (unwritten)
+		map->m_flags |= NUMBFS_MAP_UNWRITTEN;
+	mark_inode_dirty(&ni->vfs_inode);
+	return 0;
+}
+
+/* caller should hold ni->map_sem, for write if @alloc is true */
+int numbfs_ext_map(struct numbfs_inode_info *ni, struct numbfs_map *map,
+		   bool alloc)
+{
+	struct numbfs_iext *ext;
+	int idx, off, next;
+
+	idx = numbfs_ext_lookup(ni, map->m_lblk);
+	if (idx >= 0) {
+		ext = &ni->ext[idx];
+		off = map->m_lblk - ext->lblk;
+		if (off < ext->len) {
+			map->m_pblk = ext->pblk + off;
+			map->m_len = min(map->m_len, ext->len - off);
+			if (ext->unwritten)
+				map->m_flags |= NUMBFS_MAP_UNWRITTEN;
+			return 0;
+		}
+	}
+
+	/* a hole until the next extent */
+	next = idx + 1 < ni->nr_ext ? ni->ext[idx + 1].lblk : INT_MAX;
+	map->m_pblk = NUMBFS_HOLE;
+	map->m_len = min(map->m_len, next - map->m_lblk);
+	if (!alloc)
+		return 0;
+
+	return numbfs_ext_alloc(ni, map, idx, false);
+}
+
+/*
+ * Allocate unwritten blocks for the first blocks of the hole described by
+ * @map, caller should hold ni->map_sem for write.
+ */
+int numbfs_ext_prealloc(struct numbfs_inode_info *ni, struct numbfs_map *map)
+{
+	return numbfs_ext_alloc(ni, map, numbfs_ext_lookup(ni, map->m_lblk),
+				true);
+}
+
+/* the block following the last mapped block before @lblk */
+int numbfs_ext_goal(struct numbfs_inode_info *ni, int lblk)
+{
+	int idx = numbfs_ext_lookup(ni, lblk);
+
+	if (idx < 0)
+		return ni->xattr_start + 1;
+	return ni->ext[idx].pblk + lblk - ni->ext[idx].lblk;
+}
+
+/* index of the first extent ending after @lblk, or ni->nr_ext */
+static int numbfs_ext_first(struct numbfs_inode_info *ni, int lblk)
+{
+	int idx = numbfs_ext_lookup(ni, lblk);
+
+	if (idx < 0 || ni->ext[idx].lblk + ni->ext[idx].len <= lblk)
+		idx++;
+	return idx;
+}
+
+/*
+ * Cut [@lblk, @lblk + @len) out of the extent at @idx, the range must lie
+ * within it.  Unless @punch, the range is put back as written blocks.
+ */
+static int numbfs_ext_carve(struct numbfs_inode_info *ni, int idx, int lblk,
+			    int len, bool punch)
+{
+	struct numbfs_iext *ext = &ni->ext[idx];
+	struct numbfs_iext mid, tail;
+	int err;
+
+	numbfs_ext_touch(ni, idx);
+	mid.lblk = lblk;
+	mid.pblk = ext->pblk + lblk - ext->lblk;
+	mid.len = len;
+	mid.unwritten = false;
+	tail.lblk = lblk + len;
+	tail.pblk = mid.pblk + len;
+	tail.len = ext->lblk + ext->len - tail.lblk;
+	tail.unwritten = ext->unwritten;
+
+	/* the pieces that are left, in place of the extent */
+	err = numbfs_ext_reserve(ni, (lblk > ext->lblk) + !!tail.len +
+				 !punch - 1);
+	if (err)
+		return err;
+	ext = &ni->ext[idx];
+
+	if (lblk == ext->lblk) {
+		if (tail.len)
+			*ext = tail;
+		else
+			numbfs_ext_remove(ni, idx);
+		return punch ? 0 : numbfs_ext_insert(ni, idx - 1, &mid);
+	}
+
+	ext->len = lblk - ext->lblk;
+	if (tail.len)
+		numbfs_ext_insert(ni, idx, &tail);
+	return punch ? 0 : numbfs_ext_insert(ni, idx, &mid);
+}
+
+/* free the blocks of [@lblk, @lblk + @len), caller should hold ni->map_sem */
+int numbfs_ext_punch(struct numbfs_inode_info *ni, int lblk, int len)
+{
+	struct super_block *sb = ni->vfs_inode.i_sb;
+	struct numbfs_iext *ext;
+	int idx, end = lblk + len, pblk, n, err = 0;
+
+	while (lblk < end) {
+		idx = numbfs_ext_first(ni, lblk);
+		if (idx >= ni->nr_ext || ni->ext[idx].lblk >= end)
+			break;
+
+		ext = &ni->ext[idx];
+		lblk = max(lblk, ext->lblk);
+		n = min(end, ext->lblk + ext->len) - lblk;
+		pblk = ext->pblk + lblk - ext->lblk;
+		err = numbfs_ext_carve(ni, idx, lblk, n, true);
+		if (err)
+			break;
+		numbfs_bfree_range(sb, pblk, n);
+		lblk += n;
+	}
+
+	numbfs_ext_shrink(ni);
+	return err;
+}
+
+/*
+ * Mark the unwritten blocks of [@lblk, @lblk + @len) written, caller should
+ * hold ni->map_sem for write.
+ */
+int numbfs_ext_convert(struct numbfs_inode_info *ni, int lblk, int len)
+{
+	struct numbfs_iext *ext;
+	int idx, end = lblk + len, n, err = 0;
+
+	while (lblk < end) {
+		idx = numbfs_ext_first(ni, lblk);
+		if (idx >= ni->nr_ext || ni->ext[idx].lblk >= end)
+			break;
+
+		ext = &ni->ext[idx];
+		lblk = max(lblk, ext->lblk);
+		n = min(end, ext->lblk + ext->len) - lblk;
+		if (ext->unwritten) {
+			err = numbfs_ext_carve(ni, idx, lblk, n, false);
+			if (err)
+				break;
+		}
+		lblk += n;
+	}
+
+	numbfs_ext_shrink(ni);
+	return err;
+}
+
+/* free all the blocks from @lblk on, caller should hold ni->map_sem */
+int numbfs_ext_truncate(struct numbfs_inode_info *ni, int lblk)
+{
+	struct super_block *sb = ni->vfs_inode.i_sb;
+	struct numbfs_iext *ext;
+	int start;
+
+	while (ni->nr_ext) {
+		ext = &ni->ext[ni->nr_ext - 1];
+		if (ext->lblk + ext->len <= lblk)
+			break;
+
+		numbfs_ext_touch(ni, ni->nr_ext - 1);
+		start = max(ext->lblk, lblk);
+		numbfs_bfree_range(sb, ext->pblk + start - ext->lblk,
+				   ext->lblk + ext->len - start);
+
+		if (start == ext->lblk)
+			ni->nr_ext--;
+		else
+			ext->len = start - ext->lblk;
+	}
+
+	numbfs_ext_shrink(ni);
+	return 0;
+}
@@ -20,25 +20,57 @@ void numbfs_file_set_ops(struct inode *inode)
 	}
 }
 
-static void numbfs_truncate_blocks(struct inode *inode, loff_t newsize)
+static void numbfs_truncate_blocks(struct inode *inode, loff_t oldsize,
+				   loff_t newsize)
 {
 	struct numbfs_inode_info *ni = NUMBFS_I(inode);
 	loff_t i = DIV_ROUND_UP(newsize, NUMBFS_BYTES_PER_BLOCK);
+	int start = 0, run = 0;
+
+	down_write(&ni->map_sem);
+	numbfs_map_changed(ni);
+	/* the window follows the last block, keep it while that stays */
+	if (i < DIV_ROUND_UP(oldsize, NUMBFS_BYTES_PER_BLOCK))
+		numbfs_rsv_discard(ni);
+	numbfs_da_truncate(ni, min_t(loff_t, i, INT_MAX));
+	if (numbfs_has_extent(ni->sbi)) {
+		numbfs_ext_truncate(ni, min_t(loff_t, i, INT_MAX));
+		goto out;
+	}
 
-	for (; i < NUMBFS_NUM_DATA_ENTRY; i++)
-		if (ni->data[i] != NUMBFS_HOLE)
-			numbfs_bfree(inode->i_sb, ni->data[i]);
+	for (; i < NUMBFS_NUM_DATA_ENTRY; i++) {
+		if (ni->data[i] == NUMBFS_HOLE)
+			continue;
+		/* free physically contiguous blocks as one run */
+		if (run && ni->data[i] != start + run) {
+			numbfs_bfree_range(inode->i_sb, start, run);
+			run = 0;
+		}
+		if (!run)
+			start = ni->data[i];
+		run++;
+		ni->data[i] = NUMBFS_HOLE;
+	}
+	if (run)
+		numbfs_bfree_range(inode->i_sb, start, run);
+out:
+	up_write(&ni->map_sem);
+	mark_inode_dirty(inode);
 }
 
 void numbfs_setsize(struct inode *inode, loff_t newsize)
 {
+	loff_t oldsize;
+
 	filemap_invalidate_lock(inode->i_mapping);
+	oldsize = i_size_read(inode);
 	truncate_setsize(inode, newsize);
-	numbfs_truncate_blocks(inode, newsize);
+	numbfs_truncate_blocks(inode, oldsize, newsize);
 	filemap_invalidate_unlock(inode->i_mapping);
 }
 
-static int numbfs_set_timestamps(struct inode *inode)
+/* also read the root of the directory index if @dx */
+static int numbfs_set_timestamps(struct inode *inode, bool dx)
 {
 	struct numbfs_inode_info *ni = NUMBFS_I(inode);
 	struct numbfs_timestamps *nt;
@@ -60,6 +92,7 @@ static int numbfs_set_timestamps(struct inode *inode)
 	(void)inode_set_atime(inode, (time64_t)le64_to_cpu(nt->t_atime), 0);
 	(void)inode_set_mtime(inode, (time64_t)le64_to_cpu(nt->t_mtime), 0);
 	(void)inode_set_ctime(inode, (time64_t)le64_to_cpu(nt->t_ctime), 0);
+	ni->dx_root = dx ? le32_to_cpu(nt->t_dx_root) : NUMBFS_HOLE;
 
 	numbfs_bput(&buf);
 	return 0;
@@ -71,12 +104,13 @@ static int numbfs_fill_inode(struct inode *inode)
 	struct numbfs_inode_info *ni = NUMBFS_I(inode);
 	struct numbfs_buf buf;
 	struct numbfs_inode *di;
+	bool dx;
 	int err, i;
 
 	/* on-disk inode information */
 	di = numbfs_idisk(&buf, sb, inode->i_ino);
 	if (IS_ERR(di)) {
-		numbfs_ibuf_put(&buf);
+		numbfs_bput(&buf);
 		return PTR_ERR(di);
 	}
 
@@ -89,13 +123,22 @@ static int numbfs_fill_inode(struct inode *inode)
 
 	ni->sbi = NUMBFS_SB(sb);
 	ni->nid = inode->i_ino;
-	for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
-		ni->data[i] = le32_to_cpu(di->i_data[i]);
 	ni->xattr_start = le32_to_cpu(di->i_xattr_start);
 	ni->xattr_count = di->i_xattr_count;
-	numbfs_ibuf_put(&buf);
+	dx = di->i_flags & NUMBFS_IFLAG_DX;
+	if (numbfs_has_extent(ni->sbi)) {
+		err = numbfs_ext_load(ni, di);
+		if (err) {
+			numbfs_bput(&buf);
+			return err;
+		}
+	} else {
+		for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
+			ni->data[i] = le32_to_cpu(di->i_data[i]);
+	}
+	numbfs_bput(&buf);
 
-	err = numbfs_set_timestamps(inode);
+	err = numbfs_set_timestamps(inode, dx);
 	if (err)
 		return err;
 
@@ -177,8 +220,11 @@ static int numbfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
 	if (err)
 		return err;
 
-	if (iattr->ia_valid & ATTR_SIZE && iattr->ia_size != inode->i_size)
+	if (iattr->ia_valid & ATTR_SIZE && iattr->ia_size != inode->i_size) {
+		/* direct writes in flight may target the blocks to be freed */
+		inode_dio_wait(inode);
 		numbfs_setsize(inode, iattr->ia_size);
+	}
 
 	setattr_copy(&nop_mnt_idmap, inode, iattr);
 	mark_inode_dirty(inode);
@@ -190,6 +236,7 @@ static int numbfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry,
 const struct inode_operations numbfs_generic_iops = {
 	.getattr	= numbfs_getattr,
 	.setattr	= numbfs_setattr,
+	.fiemap		= numbfs_fiemap,
 };
 
 static void numbfs_link_free(void *target)
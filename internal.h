@@ -9,12 +9,12 @@
  * This header defines in-memory structures and utilities for the NUMBFS filesystem implementation.
  * It includes:
  * - Superblock information structure (cached on-disk metadata with synchronization primitives)
- * - Buffer management structure for block I/O operations
+ * - Buffer management structure for cached metadata block I/O
  * - In-memory inode information structure extending VFS inode
  * - Function declarations for filesystem operations (super, inode, file, address space ops)
  * - Utility macros and functions for:
  *   * Bitmap calculations (block and inode allocation)
- *   * Block address translation
+ *   * Block address translation (direct blocks and extents)
  *   * Inode operations
  *   * Buffer management
  *
@@ -32,44 +32,164 @@
 #include <linux/spinlock.h>
 #include <linux/statfs.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/xarray.h>
+#include <linux/rbtree.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
 #include <linux/bio.h>
+#include <linux/buffer_head.h>
 
 #define NUMBFS_BLOCK_BITS	9
 #define NUMBFS_BLOCK_SIZE	(1 << NUMBFS_BLOCK_BITS)
+#define NUMBFS_SECTOR_SHIFT	(NUMBFS_BLOCK_BITS - SECTOR_SHIFT)
+
+/* in-memory copy of an on-disk bitmap, each slice protected by its group */
+struct numbfs_bitmap {
+	/* same layout as the on-disk bitmap blocks */
+	unsigned long *map;
+	/* block addr of the first bitmap block */
+	int startblk;
+	/* number of valid bits */
+	int total;
+};
+
+/* in-memory allocation group, see alloc.c */
+struct numbfs_group {
+	/* protects everything below and the group's bitmap bits */
+	struct mutex lock;
+	/* free extents of the group's data blocks */
+	struct rb_root free_extents;
+	int free_blocks;
+	int free_inodes;
+	/* where the next search without a goal starts */
+	int bhint;
+	int ihint;
+};
 
 struct numbfs_superblock_info {
 	/* on-disk information */
 	int feature;
 	int total_inodes;
-	int free_inodes;
 	int data_blocks;
-	int free_blocks;
 	int ibitmap_start;
 	int inode_start;
 	int bbitmap_start;
 	int data_start;
 
 	int block_bits;
+	unsigned int mount_opt;
+
+	/*
+	 * Free space, exact sums are only taken near the watermark.  The
+	 * reserved blocks are promised to delayed allocations and are still
+	 * counted as free.
+	 */
+	struct percpu_counter free_blocks;
+	struct percpu_counter free_inodes;
+	struct percpu_counter reserved_blocks;
 
+	/* in-memory inode and block bitmaps */
+	struct numbfs_bitmap ibmap;
+	struct numbfs_bitmap bbmap;
+
+	/* allocation groups */
+	struct numbfs_group *groups;
+	int nr_groups;
+	int inodes_per_group;
+
+	/* inodes with a reservation window */
+	spinlock_t rsv_lock;
+	struct list_head rsv_windows;
+
+	/* serializes claims of free space near the watermark */
 	spinlock_t s_lock;
-	struct mutex s_mutex;
+
+	/* runs of freed blocks not yet returned to the groups, see alloc.c */
+	spinlock_t free_lock;
+	struct list_head pending_frees;
+	int pending_blocks;
+	/* serializes returning the pending runs */
+	struct mutex free_mutex;
+	struct delayed_work free_work;
+	struct super_block *sb;
+
+	/* writeback into unwritten blocks completes here, see data.c */
+	struct workqueue_struct *endio_wq;
+	spinlock_t ioend_lock;
+	struct list_head ioend_list;
+	struct work_struct ioend_work;
+
+	/* name caches of directories, see ncache.c */
+	spinlock_t nc_lock;
+	struct list_head nc_list;
+	atomic_long_t nc_entries;
+	struct shrinker *nc_shrinker;
  };
 
+/* mount options */
+#define NUMBFS_MOUNT_DELALLOC	0x00000001
+#define NUMBFS_MOUNT_DISCARD	0x00000002
+
+#define numbfs_test_opt(sbi, opt)	((sbi)->mount_opt & NUMBFS_MOUNT_##opt)
+
 struct numbfs_buf {
 	/* for the address space of a inode */
 	struct inode *inode;
-	/* for the address space of disk */
-	struct block_device *bdev;
+	/* for the metadata blocks cached in the address space of disk */
+	struct buffer_head *bh;
 	int blkaddr;
 	void *base;
 	struct folio *folio;
 };
 
+/* in-memory extent */
+struct numbfs_iext {
+	int lblk;
+	int pblk;
+	int len;
+	bool unwritten;
+};
+
 struct numbfs_inode_info {
 	int nid;
+	/* protects data[] and the extents */
+	struct rw_semaphore map_sem;
+	/* bumped under map_sem when blocks are unmapped or converted */
+	u32 map_seq;
 	int data[NUMBFS_NUM_DATA_ENTRY];
+	/*
+	 * NUMBFS_FEATURE_EXTENT: extents sorted by lblk, @ext points to
+	 * @ext_inline, or to an array of @ext_cap entries once the inline
+	 * ones are used up.  @ext_tree holds the block addrs of the extent
+	 * tree, see extent.c.
+	 */
+	struct numbfs_iext *ext;
+	int nr_ext;
+	int ext_cap;
+	struct numbfs_iext ext_inline[NUMBFS_INLINE_EXTENTS];
+	int *ext_tree;
+	int nr_tree;
+	int tree_cap;
+	/* first extent changed since the tree was written, or INT_MAX */
+	int ext_dirty;
+	/* the tree changed its shape since it was written */
+	bool ext_reshaped;
+	/* logical blocks reserved but not yet allocated (delalloc) */
+	struct xarray delalloc;
+	/* reservation window for the next appends, see alloc.c */
+	int rsv_start;
+	int rsv_len;
+	struct list_head rsv_list;
 	int xattr_start;
 	short xattr_count;
+	/* root of the directory index, or NUMBFS_HOLE, see dindex.c */
+	int dx_root;
+	/* compact dirents: the first block that may have room for a dirent */
+	int dir_free;
+	/* name cache, or NULL, see ncache.c */
+	spinlock_t nc_lock;
+	struct numbfs_ncache *ncache;
 	struct numbfs_superblock_info *sbi;
 	struct inode vfs_inode;
 };
@@ -91,6 +211,63 @@ extern const struct address_space_operations numbfs_aops;
 
 #define NUMBFS_SB(sb) ((struct numbfs_superblock_info*)(sb->s_fs_info))
 
+static inline bool numbfs_has_extent(struct numbfs_superblock_info *sbi)
+{
+	return sbi->feature & NUMBFS_FEATURE_EXTENT;
+}
+
+static inline bool numbfs_has_dir_index(struct numbfs_superblock_info *sbi)
+{
+	return sbi->feature & NUMBFS_FEATURE_DIR_INDEX;
+}
+
+static inline bool numbfs_has_large_ino(struct numbfs_superblock_info *sbi)
+{
+	return sbi->feature & NUMBFS_FEATURE_LARGE_INO;
+}
+
+static inline bool numbfs_has_compact_dirent(struct numbfs_superblock_info *sbi)
+{
+	return sbi->feature & NUMBFS_FEATURE_COMPACT_DIRENT;
+}
+
+/*
+ * Writeback of delayed allocations may need blocks for the extent tree, and
+ * it can't fail with ENOSPC once the data was accepted.  So data claims
+ * leave this many free blocks to metadata allocations, as ext4 does with
+ * its reserved clusters.
+ */
+static inline int numbfs_meta_reserve(struct numbfs_superblock_info *sbi)
+{
+	return min(sbi->data_blocks / 50, 4096);
+}
+
+static inline int numbfs_max_namelen(struct numbfs_superblock_info *sbi)
+{
+	if (numbfs_has_compact_dirent(sbi))
+		return NUMBFS_CDIRENT_MAX_NAME;
+	return numbfs_has_large_ino(sbi) ? NUMBFS_LARGE_INO_PATH_LEN :
+					   NUMBFS_MAX_PATH_LEN;
+}
+
+static inline int numbfs_dirent_ino(struct numbfs_superblock_info *sbi,
+				    struct numbfs_dirent *de)
+{
+	int ino = le16_to_cpu(de->ino);
+
+	if (numbfs_has_large_ino(sbi))
+		ino |= le16_to_cpu(de->ino_hi) << 16;
+	return ino;
+}
+
+static inline void numbfs_dirent_set_ino(struct numbfs_superblock_info *sbi,
+					 struct numbfs_dirent *de, int ino)
+{
+	de->ino = cpu_to_le16(ino);
+	if (numbfs_has_large_ino(sbi))
+		de->ino_hi = cpu_to_le16(ino >> 16);
+}
+
 /* inode */
 #define NUMBFS_I(ptr)	container_of(ptr, struct numbfs_inode_info, vfs_inode)
 struct inode *numbfs_iget(struct super_block *sb, int nid);
@@ -121,6 +298,21 @@ static inline int numbfs_bmap_bit(int blkno)
 	return (blkno % NUMBFS_BLOCKS_PER_BLOCK) % NUMBFS_BITS_PER_BYTE;
 }
 
+/* data blocks per allocation group, one bitmap block each */
+#define NUMBFS_GROUP_BLOCKS	NUMBFS_BLOCKS_PER_BLOCK
+
+static inline int numbfs_group_first_block(struct numbfs_superblock_info *sbi,
+					   int g)
+{
+	return min(g * NUMBFS_GROUP_BLOCKS, sbi->data_blocks);
+}
+
+static inline int numbfs_group_first_inode(struct numbfs_superblock_info *sbi,
+					   int g)
+{
+	return min(g * sbi->inodes_per_group, sbi->total_inodes);
+}
+
 static inline int numbfs_inode_blk(struct numbfs_superblock_info *sbi,
 				   int nid)
 {
@@ -136,35 +328,160 @@ static inline int numbfs_data_blk(struct numbfs_superblock_info *sbi,
 /* read inode data */
 void numbfs_ibuf_init(struct numbfs_buf *buf, struct inode *inode, int blk);
 int numbfs_ibuf_read(struct numbfs_buf *buf);
+int numbfs_ibuf_read_ra(struct numbfs_buf *buf, struct file_ra_state *ra,
+			struct file *file, unsigned long nr);
 void numbfs_ibuf_put(struct numbfs_buf *buf);
 
-/* read disk data via bio */
+/* read/write disk data via the metadata cache */
 #define NUMBFS_READ     0
 #define NUMBFS_WRITE    1
 
 int numbfs_binit(struct numbfs_buf *buf, struct block_device *bdev,
 		 int blk);
 int numbfs_brw(struct numbfs_buf *buf, int rw);
+int numbfs_bsync(struct numbfs_buf *buf);
+void numbfs_bzero(struct numbfs_buf *buf);
+void numbfs_bcopy(struct numbfs_buf *buf, const void *data);
 void numbfs_bput(struct numbfs_buf *buf);
 
+/* asynchronous block I/O, batched under a blk_plug */
+void numbfs_bsubmit(struct numbfs_buf *buf, int rw);
+int numbfs_bwait(struct numbfs_buf *buf);
+int numbfs_brw_batch(struct numbfs_buf *bufs, int nr, int rw);
+void numbfs_breadahead(struct block_device *bdev, int blk, int nr);
+
+int numbfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		  u64 start, u64 len);
+int numbfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
+/* completion of writeback into unwritten blocks */
+int numbfs_endio_init(struct super_block *sb);
+void numbfs_endio_destroy(struct numbfs_superblock_info *sbi);
 
 /* caller should put the buf */
 struct numbfs_inode *numbfs_idisk(struct numbfs_buf *buf,
 				  struct super_block *sb, int nid);
 
-int numbfs_iaddrspace_blkaddr(struct numbfs_inode_info *ni,
-			      unsigned long pos, bool alloc);
+/* a run of blocks in the address space of an inode */
+struct numbfs_map {
+	/* first logical block */
+	int m_lblk;
+	/* number of blocks, wanted on input and mapped on output */
+	int m_len;
+	/* first data block, or NUMBFS_HOLE */
+	int m_pblk;
+	int m_flags;
+	/* ni->map_seq when the run was mapped */
+	u32 m_seq;
+};
+
+/* the blocks were allocated or reserved by this mapping */
+#define NUMBFS_MAP_NEW		0x1
+/* the blocks are reserved, but have no data block yet */
+#define NUMBFS_MAP_DELALLOC	0x2
+/* the blocks are allocated, but not written yet */
+#define NUMBFS_MAP_UNWRITTEN	0x4
+
+/*
+ * Mappings cached outside map_sem, such as the one writeback reuses for
+ * the following folios, are only valid while ni->map_seq is unchanged.
+ * Caller should hold ni->map_sem for write.
+ */
+static inline void numbfs_map_changed(struct numbfs_inode_info *ni)
+{
+	WRITE_ONCE(ni->map_seq, ni->map_seq + 1);
+}
+
+int numbfs_iaddrspace_map(struct numbfs_inode_info *ni,
+			  struct numbfs_map *map, bool alloc);
+int numbfs_iaddrspace_reserve(struct numbfs_inode_info *ni,
+			      struct numbfs_map *map);
+int numbfs_data_balloc(struct numbfs_inode_info *ni, int lblk, int *blk,
+		       int *len);
+void numbfs_da_release(struct numbfs_inode_info *ni, unsigned long first,
+		       unsigned long last);
+void numbfs_da_truncate(struct numbfs_inode_info *ni, int lblk);
+int numbfs_iaddrspace_prealloc(struct numbfs_inode_info *ni, int lblk,
+			       int len);
+int numbfs_iaddrspace_punch(struct numbfs_inode_info *ni, int lblk, int len);
+int numbfs_iaddrspace_convert(struct numbfs_inode_info *ni, int lblk,
+			      int len);
 
 /* block management */
-int numbfs_balloc(struct super_block *sb, int *blk);
+#define NUMBFS_BITMAP_BATCH	16
+int numbfs_bitmap_load(struct super_block *sb, struct numbfs_bitmap *bm,
+		       int startblk, int total);
+void numbfs_bitmap_release(struct numbfs_bitmap *bm);
+int numbfs_balloc(struct super_block *sb, int goal, int *blk);
+int numbfs_balloc_range(struct super_block *sb, struct numbfs_inode_info *ni,
+			int goal, int *blk, int *len, bool resv);
+void numbfs_rsv_discard(struct numbfs_inode_info *ni);
+int numbfs_bfree_range(struct super_block *sb, int blk, int len);
+int numbfs_groups_init(struct numbfs_superblock_info *sbi);
+void numbfs_groups_release(struct numbfs_superblock_info *sbi);
 int numbfs_bfree(struct super_block *sb, int blk);
-int numbfs_ialloc(struct super_block *sb, int *nid);
+void numbfs_frees_init(struct super_block *sb);
+bool numbfs_flush_frees(struct super_block *sb);
+int numbfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
+int numbfs_breserve(struct super_block *sb, int *nr);
+void numbfs_brelease(struct super_block *sb, int nr);
+int numbfs_ialloc(struct inode *dir, umode_t mode, int *nid);
 int numbfs_ifree(struct super_block *sb, int nid);
 
+/* extent.c */
+int numbfs_ext_load(struct numbfs_inode_info *ni, struct numbfs_inode *di);
+int numbfs_ext_dump(struct numbfs_inode_info *ni, struct numbfs_inode *di);
+void numbfs_ext_init(struct numbfs_inode_info *ni);
+void numbfs_ext_destroy(struct numbfs_inode_info *ni);
+int numbfs_ext_map(struct numbfs_inode_info *ni, struct numbfs_map *map,
+		   bool alloc);
+int numbfs_ext_prealloc(struct numbfs_inode_info *ni, struct numbfs_map *map);
+int numbfs_ext_punch(struct numbfs_inode_info *ni, int lblk, int len);
+int numbfs_ext_convert(struct numbfs_inode_info *ni, int lblk, int len);
+int numbfs_ext_truncate(struct numbfs_inode_info *ni, int lblk);
+int numbfs_ext_goal(struct numbfs_inode_info *ni, int lblk);
+
+/* a dirent decoded from either on-disk format */
+struct numbfs_dent {
+	const char *name;
+	/* 0 for an unused compact dirent */
+	int namelen;
+	int ino;
+	unsigned char type;
+	/* bytes to the next dirent */
+	int reclen;
+};
+
 /* dir.c */
 void numbfs_dir_set_ops(struct inode *inode);
+int numbfs_dir_get(struct inode *dir, loff_t pos, struct numbfs_buf *buf,
+		   struct numbfs_dent *d);
+
+/* ncache.c */
+int numbfs_nc_lookup(struct inode *dir, const char *name, int namelen,
+		     int *nid, int *pos);
+void numbfs_nc_add(struct inode *dir, const char *name, int namelen,
+		   int nid, int pos);
+void numbfs_nc_delete(struct inode *dir, const char *name, int namelen);
+void numbfs_nc_drop(struct inode *dir);
+int numbfs_ncache_init(struct super_block *sb);
+void numbfs_ncache_destroy(struct numbfs_superblock_info *sbi);
+
+/* dindex.c */
+int numbfs_dx_lookup(struct inode *dir, const char *name, int namelen,
+		     int *nid, int *offset);
+int numbfs_dx_add(struct inode *dir, const char *name, int namelen, int pos);
+int numbfs_dx_delete(struct inode *dir, const char *name, int namelen,
+		     int pos);
+int numbfs_dx_move(struct inode *dir, const char *name, int namelen,
+		   int from, int to);
+int numbfs_dx_build(struct inode *dir);
+void numbfs_dx_destroy(struct inode *dir);
 
 /* xattr.c */
 extern const struct xattr_handler * const numbfs_xattr_handlers[];
 
+/* ioctl.c */
+long numbfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
 #endif
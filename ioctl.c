@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ */
+
+#include "internal.h"
+#include <linux/blkdev.h>
+#include <linux/compat.h>
+#include <linux/uaccess.h>
+
+static int numbfs_ioc_trim(struct file *file, void __user *arg)
+{
+	struct super_block *sb = file_inode(file)->i_sb;
+	struct fstrim_range range;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!bdev_max_discard_sectors(sb->s_bdev))
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&range, arg, sizeof(range)))
+		return -EFAULT;
+
+	range.minlen = max_t(u64, range.minlen,
+			     bdev_discard_granularity(sb->s_bdev));
+	err = numbfs_trim_fs(sb, &range);
+	if (err < 0)
+		return err;
+
+	if (copy_to_user(arg, &range, sizeof(range)))
+		return -EFAULT;
+	return 0;
+}
+
+long numbfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	switch (cmd) {
+	case FITRIM:
+		return numbfs_ioc_trim(file, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
@@ -0,0 +1,369 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Copyright (C) 2025, Hongzhen Luo
+ *
+ * In-memory name cache of directories.
+ *
+ * The first lookup in a directory reads all of its dirents into a hash
+ * table of names, so later lookups, including the ones that prove a name
+ * is absent before a create, are a single probe.  A table always holds
+ * every name of its directory: dirent updates keep it in sync, and
+ * anything that would leave it incomplete drops it instead.
+ *
+ * Tables are built and updated under the directory's i_rwsem, but probes
+ * only hold it shared and the shrinker not at all, so ni->nc_lock
+ * protects the table.  All the tables of a file system are on
+ * sbi->nc_list, the shrinker drops the ones that were not probed since
+ * it last looked at them.  ni->nc_lock nests outside sbi->nc_lock.
+ */
+
+#include "internal.h"
+#include <linux/hash.h>
+#include <linux/stringhash.h>
+#include <linux/shrinker.h>
+
+/* larger directories are left to the directory index */
+#define NUMBFS_NC_MAX_SIZE	(1 << 20)
+#define NUMBFS_NC_MIN_BITS	4
+
+struct numbfs_nc_entry {
+	struct hlist_node node;
+	u32 hash;
+	int nid;
+	/* position of the dirent */
+	int pos;
+	u8 namelen;
+	char name[];
+};
+
+struct numbfs_ncache {
+	struct numbfs_inode_info *ni;
+	/* on sbi->nc_list */
+	struct list_head lru;
+	/* probed since the shrinker last saw it */
+	bool referenced;
+	unsigned int bits;
+	unsigned int count;
+	struct hlist_head table[];
+};
+
+static u32 numbfs_nc_hash(const char *name, int namelen)
+{
+	return full_name_hash(NULL, name, namelen);
+}
+
+static struct numbfs_nc_entry *numbfs_nc_alloc(const char *name,
+					       int namelen, int nid, int pos)
+{
+	struct numbfs_nc_entry *e;
+
+	e = kmalloc(struct_size(e, name, namelen), GFP_NOFS);
+	if (!e)
+		return NULL;
+
+	e->hash = numbfs_nc_hash(name, namelen);
+	e->nid = nid;
+	e->pos = pos;
+	e->namelen = namelen;
+	memcpy(e->name, name, namelen);
+	return e;
+}
+
+static struct numbfs_nc_entry *numbfs_nc_find(struct numbfs_ncache *nc,
+					      const char *name, int namelen)
+{
+	u32 hash = numbfs_nc_hash(name, namelen);
+	struct numbfs_nc_entry *e;
+
+	hlist_for_each_entry(e, &nc->table[hash_32(hash, nc->bits)], node)
+		if (e->hash == hash && e->namelen == namelen &&
+		    !memcmp(e->name, name, namelen))
+			return e;
+	return NULL;
+}
+
+static void numbfs_nc_free(struct numbfs_ncache *nc)
+{
+	struct numbfs_nc_entry *e;
+	struct hlist_node *n;
+	int i;
+
+	for (i = 0; i < 1 << nc->bits; i++)
+		hlist_for_each_entry_safe(e, n, &nc->table[i], node)
+			kfree(e);
+	kvfree(nc);
+}
+
+/* read every name of @dir into a new table */
+static struct numbfs_ncache *numbfs_nc_build(struct inode *dir)
+{
+	struct numbfs_nc_entry *e;
+	struct numbfs_ncache *nc = NULL;
+	struct numbfs_buf buf;
+	struct numbfs_dent d;
+	struct hlist_node *n;
+	HLIST_HEAD(names);
+	unsigned int count = 0, bits, i;
+	loff_t pos;
+	int err = 0;
+
+	numbfs_ibuf_init(&buf, dir, 0);
+	for (pos = 0; pos < i_size_read(dir); pos += d.reclen) {
+		err = numbfs_dir_get(dir, pos, &buf, &d);
+		if (err)
+			break;
+		if (!d.namelen)
+			continue;
+
+		e = numbfs_nc_alloc(d.name, d.namelen, d.ino, pos);
+		if (!e) {
+			err = -ENOMEM;
+			break;
+		}
+		hlist_add_head(&e->node, &names);
+		count++;
+	}
+	numbfs_ibuf_put(&buf);
+
+	bits = max_t(unsigned int, NUMBFS_NC_MIN_BITS, order_base_2(count));
+	if (!err)
+		nc = kvmalloc(struct_size(nc, table, 1U << bits), GFP_NOFS);
+	if (nc) {
+		nc->ni = NUMBFS_I(dir);
+		INIT_LIST_HEAD(&nc->lru);
+		nc->referenced = true;
+		nc->bits = bits;
+		nc->count = count;
+		for (i = 0; i < 1U << bits; i++)
+			INIT_HLIST_HEAD(&nc->table[i]);
+	}
+
+	hlist_for_each_entry_safe(e, n, &names, node) {
+		hlist_del(&e->node);
+		if (nc)
+			hlist_add_head(&e->node,
+				       &nc->table[hash_32(e->hash, bits)]);
+		else
+			kfree(e);
+	}
+	return nc;
+}
+
+/* take the table off @dir, caller holds ni->nc_lock */
+static struct numbfs_ncache *numbfs_nc_detach(struct numbfs_inode_info *ni)
+{
+	struct numbfs_ncache *nc = ni->ncache;
+
+	if (nc) {
+		spin_lock(&ni->sbi->nc_lock);
+		list_del(&nc->lru);
+		spin_unlock(&ni->sbi->nc_lock);
+		atomic_long_sub(nc->count, &ni->sbi->nc_entries);
+		ni->ncache = NULL;
+	}
+	return nc;
+}
+
+/*
+ * Look @name up in the name cache of @dir, which is built first if needed.
+ * Returns -EAGAIN if @dir has no name cache.
+ */
+int numbfs_nc_lookup(struct inode *dir, const char *name, int namelen,
+		     int *nid, int *pos)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	struct numbfs_superblock_info *sbi = ni->sbi;
+	struct numbfs_nc_entry *e;
+	struct numbfs_ncache *nc;
+	int err;
+
+	if (!READ_ONCE(ni->ncache)) {
+		if (i_size_read(dir) > NUMBFS_NC_MAX_SIZE)
+			return -EAGAIN;
+
+		nc = numbfs_nc_build(dir);
+		if (!nc)
+			return -EAGAIN;
+
+		/* a concurrent lookup may have built one as well */
+		spin_lock(&ni->nc_lock);
+		if (!ni->ncache) {
+			ni->ncache = nc;
+			spin_lock(&sbi->nc_lock);
+			list_add_tail(&nc->lru, &sbi->nc_list);
+			spin_unlock(&sbi->nc_lock);
+			atomic_long_add(nc->count, &sbi->nc_entries);
+			nc = NULL;
+		}
+		spin_unlock(&ni->nc_lock);
+		if (nc)
+			numbfs_nc_free(nc);
+	}
+
+	err = -EAGAIN;
+	spin_lock(&ni->nc_lock);
+	nc = ni->ncache;
+	if (nc) {
+		WRITE_ONCE(nc->referenced, true);
+		e = numbfs_nc_find(nc, name, namelen);
+		err = -ENOENT;
+		if (e) {
+			*nid = e->nid;
+			if (pos)
+				*pos = e->pos;
+			err = 0;
+		}
+	}
+	spin_unlock(&ni->nc_lock);
+	return err;
+}
+
+/* the dirent of @name now is at @pos and points to @nid */
+void numbfs_nc_add(struct inode *dir, const char *name, int namelen,
+		   int nid, int pos)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	struct numbfs_nc_entry *e, *old;
+	struct numbfs_ncache *nc;
+
+	/* the caller holds i_rwsem, so no table is being built */
+	if (!READ_ONCE(ni->ncache))
+		return;
+
+	e = numbfs_nc_alloc(name, namelen, nid, pos);
+
+	spin_lock(&ni->nc_lock);
+	nc = ni->ncache;
+	if (!nc)
+		goto out;
+
+	old = numbfs_nc_find(nc, name, namelen);
+	if (old) {
+		old->nid = nid;
+		old->pos = pos;
+		goto out;
+	}
+
+	/* out of memory or too crowded, the next lookup builds a new one */
+	if (!e || nc->count >= 2U << nc->bits) {
+		nc = numbfs_nc_detach(ni);
+		spin_unlock(&ni->nc_lock);
+		numbfs_nc_free(nc);
+		kfree(e);
+		return;
+	}
+
+	hlist_add_head(&e->node, &nc->table[hash_32(e->hash, nc->bits)]);
+	nc->count++;
+	atomic_long_inc(&ni->sbi->nc_entries);
+	e = NULL;
+out:
+	spin_unlock(&ni->nc_lock);
+	kfree(e);
+}
+
+/* the dirent of @name is gone */
+void numbfs_nc_delete(struct inode *dir, const char *name, int namelen)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	struct numbfs_nc_entry *e = NULL;
+	struct numbfs_ncache *nc;
+
+	spin_lock(&ni->nc_lock);
+	nc = ni->ncache;
+	if (nc) {
+		e = numbfs_nc_find(nc, name, namelen);
+		if (e) {
+			hlist_del(&e->node);
+			nc->count--;
+			atomic_long_dec(&ni->sbi->nc_entries);
+		}
+	}
+	spin_unlock(&ni->nc_lock);
+	kfree(e);
+}
+
+/* drop the name cache of @dir */
+void numbfs_nc_drop(struct inode *dir)
+{
+	struct numbfs_inode_info *ni = NUMBFS_I(dir);
+	struct numbfs_ncache *nc;
+
+	if (!READ_ONCE(ni->ncache))
+		return;
+
+	spin_lock(&ni->nc_lock);
+	nc = numbfs_nc_detach(ni);
+	spin_unlock(&ni->nc_lock);
+	if (nc)
+		numbfs_nc_free(nc);
+}
+
+static unsigned long numbfs_nc_count(struct shrinker *shrink,
+				     struct shrink_control *sc)
+{
+	struct numbfs_superblock_info *sbi = shrink->private_data;
+
+	return atomic_long_read(&sbi->nc_entries) ?: SHRINK_EMPTY;
+}
+
+static unsigned long numbfs_nc_scan(struct shrinker *shrink,
+				    struct shrink_control *sc)
+{
+	struct numbfs_superblock_info *sbi = shrink->private_data;
+	struct numbfs_ncache *nc, *n;
+	unsigned long freed = 0;
+	LIST_HEAD(scan);
+	LIST_HEAD(dispose);
+
+	spin_lock(&sbi->nc_lock);
+	/* look at each table once, the ones kept go to the tail */
+	list_splice_init(&sbi->nc_list, &scan);
+	while (!list_empty(&scan) && freed < sc->nr_to_scan) {
+		nc = list_first_entry(&scan, struct numbfs_ncache, lru);
+		if (READ_ONCE(nc->referenced) ||
+		    !spin_trylock(&nc->ni->nc_lock)) {
+			WRITE_ONCE(nc->referenced, false);
+			list_move_tail(&nc->lru, &sbi->nc_list);
+			continue;
+		}
+
+		nc->ni->ncache = NULL;
+		freed += nc->count;
+		spin_unlock(&nc->ni->nc_lock);
+		list_move(&nc->lru, &dispose);
+	}
+	list_splice(&scan, &sbi->nc_list);
+	spin_unlock(&sbi->nc_lock);
+	atomic_long_sub(freed, &sbi->nc_entries);
+
+	list_for_each_entry_safe(nc, n, &dispose, lru)
+		numbfs_nc_free(nc);
+	return freed;
+}
+
+int numbfs_ncache_init(struct super_block *sb)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+
+	spin_lock_init(&sbi->nc_lock);
+	INIT_LIST_HEAD(&sbi->nc_list);
+	atomic_long_set(&sbi->nc_entries, 0);
+
+	sbi->nc_shrinker = shrinker_alloc(0, "numbfs-ncache:%s", sb->s_id);
+	if (!sbi->nc_shrinker)
+		return -ENOMEM;
+
+	sbi->nc_shrinker->count_objects = numbfs_nc_count;
+	sbi->nc_shrinker->scan_objects = numbfs_nc_scan;
+	sbi->nc_shrinker->private_data = sbi;
+	shrinker_register(sbi->nc_shrinker);
+	return 0;
+}
+
+void numbfs_ncache_destroy(struct numbfs_superblock_info *sbi)
+{
+	if (sbi->nc_shrinker)
+		shrinker_free(sbi->nc_shrinker);
+	sbi->nc_shrinker = NULL;
+}
@@ -8,10 +8,30 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/fs_context.h>
+#include <linux/fs_parser.h>
+#include <linux/seq_file.h>
 #include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/blkdev.h>
 
 static struct kmem_cache *numbfs_inode_cachep __read_mostly;
 
+/* mount options parsed before the superblock is set up */
+struct numbfs_fs_context {
+	unsigned int mount_opt;
+};
+
+enum {
+	Opt_delalloc,
+	Opt_discard,
+};
+
+static const struct fs_parameter_spec numbfs_fs_parameters[] = {
+	fsparam_flag_no("delalloc", Opt_delalloc),
+	fsparam_flag_no("discard", Opt_discard),
+	{}
+};
+
 static void numbfs_inode_init_once(void *ptr)
 {
 	struct numbfs_inode_info *ni = ptr;
@@ -29,6 +49,10 @@ static struct inode *numbfs_alloc_inode(struct super_block *sb)
 
 	/* set everything except vfs_inode to zero */
 	memset(ni, 0, offsetof(struct numbfs_inode_info, vfs_inode));
+	init_rwsem(&ni->map_sem);
+	spin_lock_init(&ni->nc_lock);
+	xa_init(&ni->delalloc);
+	INIT_LIST_HEAD(&ni->rsv_list);
 	return &ni->vfs_inode;
 }
 
@@ -36,10 +60,13 @@ static void numbfs_free_inode(struct inode *inode)
 {
 	struct numbfs_inode_info *ni = NUMBFS_I(inode);
 
+	numbfs_ext_destroy(ni);
+	xa_destroy(&ni->delalloc);
 	kmem_cache_free(numbfs_inode_cachep, ni);
 }
 
-static void numbfs_put_super(struct super_block *sb)
+/* write the in-memory superblock to the metadata cache, and to disk if @wait */
+static int numbfs_write_super(struct super_block *sb, int wait)
 {
 	struct numbfs_buf buf;
 	struct numbfs_super_block *nsb;
@@ -68,94 +95,156 @@ static void numbfs_put_super(struct super_block *sb)
 
 	nsb->s_feature		= cpu_to_le32(sbi->feature);
 	nsb->s_total_inodes	= cpu_to_le32(sbi->total_inodes);
-	nsb->s_free_inodes	= cpu_to_le32(sbi->free_inodes);
+	nsb->s_free_inodes	=
+		cpu_to_le32(percpu_counter_sum_positive(&sbi->free_inodes));
 	nsb->s_data_blocks	= cpu_to_le32(sbi->data_blocks);
-	nsb->s_free_blocks	= cpu_to_le32(sbi->free_blocks);
+	nsb->s_free_blocks	=
+		cpu_to_le32(percpu_counter_sum_positive(&sbi->free_blocks));
 	nsb->s_ibitmap_start	= cpu_to_le32(sbi->ibitmap_start);
 	nsb->s_inode_start	= cpu_to_le32(sbi->inode_start);
 	nsb->s_bbitmap_start	= cpu_to_le32(sbi->bbitmap_start);
 	nsb->s_data_start	= cpu_to_le32(sbi->data_start);
 
 	err = numbfs_brw(&buf, NUMBFS_WRITE);
+	if (!err && wait)
+		err = numbfs_bsync(&buf);
 	if (err)
 		pr_err("numbfs: failded to write superblock to disk.\n");
 exit:
 	numbfs_bput(&buf);
+	return err;
+}
+
+static void numbfs_put_super(struct super_block *sb)
+{
+	cancel_delayed_work_sync(&NUMBFS_SB(sb)->free_work);
+	numbfs_flush_frees(sb);
+	numbfs_write_super(sb, 0);
+	numbfs_endio_destroy(NUMBFS_SB(sb));
+	numbfs_ncache_destroy(NUMBFS_SB(sb));
 }
 
-static void numbfs_dump_inode(struct inode *inode, struct numbfs_inode *di)
+static int numbfs_sync_fs(struct super_block *sb, int wait)
+{
+	numbfs_flush_frees(sb);
+	return numbfs_write_super(sb, wait);
+}
+
+static int numbfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	s64 bfree;
+
+	bfree = percpu_counter_sum_positive(&sbi->free_blocks) -
+		percpu_counter_sum_positive(&sbi->reserved_blocks) +
+		READ_ONCE(sbi->pending_blocks);
+
+	buf->f_type	= NUMBFS_MAGIC;
+	buf->f_bsize	= NUMBFS_BYTES_PER_BLOCK;
+	buf->f_blocks	= sbi->data_blocks;
+	buf->f_bfree	= max_t(s64, bfree, 0);
+	/* the metadata reserve is not available to data */
+	buf->f_bavail	= max_t(s64, bfree - numbfs_meta_reserve(sbi), 0);
+	buf->f_files	= sbi->total_inodes;
+	buf->f_ffree	= percpu_counter_sum_positive(&sbi->free_inodes);
+	buf->f_namelen	= numbfs_max_namelen(sbi);
+	buf->f_fsid	= u64_to_fsid(huge_encode_dev(sb->s_bdev->bd_dev));
+	return 0;
+}
+
+static int numbfs_dump_inode(struct inode *inode, struct numbfs_inode *di)
 {
 	struct numbfs_inode_info *ni = NUMBFS_I(inode);
 	int i;
 
 	di->i_ino	= cpu_to_le16(inode->i_ino);
+	if (numbfs_has_large_ino(ni->sbi))
+		di->i_ino_hi = cpu_to_le16(inode->i_ino >> 16);
 	di->i_mode	= cpu_to_le32(inode->i_mode);
 	di->i_nlink	= cpu_to_le16(inode->i_nlink);
 	di->i_uid	= cpu_to_le16(__kuid_val(inode->i_uid));
 	di->i_gid	= cpu_to_le16(__kgid_val(inode->i_gid));
 	di->i_size	= cpu_to_le32(inode->i_size);
-	for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
-		di->i_data[i] = cpu_to_le32(ni->data[i]);
 	di->i_xattr_start = cpu_to_le32(ni->xattr_start);
 	di->i_xattr_count = ni->xattr_count;
+	di->i_flags	= ni->dx_root != NUMBFS_HOLE ? NUMBFS_IFLAG_DX : 0;
+	if (numbfs_has_extent(ni->sbi))
+		return numbfs_ext_dump(ni, di);
+
+	for (i = 0; i < NUMBFS_NUM_DATA_ENTRY; i++)
+		di->i_data[i] = cpu_to_le32(ni->data[i]);
+	return 0;
 }
 
-static int numbfs_dump_timestamps(struct inode *inode)
+/* caller should put the buf */
+static int numbfs_dump_timestamps(struct inode *inode, struct numbfs_buf *buf)
 {
 	struct numbfs_inode_info *ni = NUMBFS_I(inode);
 	struct numbfs_timestamps *nt;
-	struct numbfs_buf buf;
 	int err;
 
-	err = numbfs_binit(&buf, inode->i_sb->s_bdev,
+	err = numbfs_binit(buf, inode->i_sb->s_bdev,
 			   numbfs_data_blk(ni->sbi, ni->xattr_start));
 	if (err)
 		return err;
 
 	/*
-	 * We have to read first because NumbFS's block size is 512B, which is
-	 * smaller than the page size (4K), so we must ensure that the subsequent
-	 * blocks in the page match those on the disk.
+	 * The timestamps share the block with the xattr entries, so this is
+	 * normally a cache hit.  Only this 512B block is written back later.
 	 */
-	err = numbfs_brw(&buf, NUMBFS_READ);
+	err = numbfs_brw(buf, NUMBFS_READ);
 	if (err)
 		return err;
 
-	nt = (struct numbfs_timestamps*)buf.base;
+	nt = (struct numbfs_timestamps*)buf->base;
 	nt->t_atime = cpu_to_le64((long)inode_get_atime_sec(inode));
 	nt->t_mtime = cpu_to_le64((long)inode_get_mtime_sec(inode));
 	nt->t_ctime = cpu_to_le64((long)inode_get_ctime_sec(inode));
+	if (ni->dx_root != NUMBFS_HOLE)
+		nt->t_dx_root = cpu_to_le32(ni->dx_root);
 
-	err = numbfs_brw(&buf, NUMBFS_WRITE);
-	numbfs_bput(&buf);
-	return err;
+	return numbfs_brw(buf, NUMBFS_WRITE);
 }
 
-static int numbfs_write_inode_meta(struct inode *inode)
+static int numbfs_write_inode_meta(struct inode *inode, bool sync)
 {
-	struct numbfs_buf buf;
+	struct numbfs_buf bufs[2];
 	struct numbfs_inode *di;
 	int nid = inode->i_ino;
 	int err;
 
-	di = numbfs_idisk(&buf, inode->i_sb, nid);
+	bufs[1].bh = NULL;
+	di = numbfs_idisk(&bufs[0], inode->i_sb, nid);
 	if (IS_ERR(di)) {
-		numbfs_bput(&buf);
-		return PTR_ERR(di);
+		err = PTR_ERR(di);
+		goto out;
 	}
 
-	numbfs_dump_inode(inode, di);
-	err = numbfs_brw(&buf, NUMBFS_WRITE);
-	numbfs_bput(&buf);
+	err = numbfs_dump_inode(inode, di);
 	if (err)
-		return err;
+		goto out;
+
+	err = numbfs_brw(&bufs[0], NUMBFS_WRITE);
+	if (err)
+		goto out;
 
-	return numbfs_dump_timestamps(inode);
+	err = numbfs_dump_timestamps(inode, &bufs[1]);
+	if (err)
+		goto out;
+
+	/* write the inode and its timestamps together */
+	if (sync)
+		err = numbfs_brw_batch(bufs, 2, NUMBFS_WRITE);
+out:
+	numbfs_bput(&bufs[0]);
+	numbfs_bput(&bufs[1]);
+	return err;
 }
 
 static int numbfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
-	return numbfs_write_inode_meta(inode);
+	return numbfs_write_inode_meta(inode, wbc->sync_mode == WB_SYNC_ALL);
 }
 
 /**
@@ -170,16 +259,38 @@ static int numbfs_drop_inode(struct inode *inode)
 
 static void numbfs_evict_inode(struct inode *inode)
 {
+	struct numbfs_inode_info *ni = NUMBFS_I(inode);
+
 	truncate_inode_pages_final(&inode->i_data);
+	numbfs_rsv_discard(ni);
+	numbfs_nc_drop(inode);
 
 	if (!inode->i_nlink) {
 		(void)numbfs_ifree(inode->i_sb, inode->i_ino);
+		numbfs_dx_destroy(inode);
 		numbfs_setsize(inode, 0);
+		(void)numbfs_bfree(inode->i_sb, ni->xattr_start);
+	} else {
+		/* reservations of blocks that were never written back */
+		down_write(&ni->map_sem);
+		numbfs_da_truncate(ni, 0);
+		up_write(&ni->map_sem);
 	}
 
 	clear_inode(inode);
 }
 
+static int numbfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct numbfs_superblock_info *sbi = NUMBFS_SB(root->d_sb);
+
+	if (!numbfs_test_opt(sbi, DELALLOC))
+		seq_puts(seq, ",nodelalloc");
+	if (numbfs_test_opt(sbi, DISCARD))
+		seq_puts(seq, ",discard");
+	return 0;
+}
+
 const struct super_operations numbfs_sops = {
 	.alloc_inode	= numbfs_alloc_inode,
 	.free_inode	= numbfs_free_inode,
@@ -187,6 +298,9 @@ const struct super_operations numbfs_sops = {
 	.drop_inode	= numbfs_drop_inode,
 	.evict_inode	= numbfs_evict_inode,
 	.put_super	= numbfs_put_super,
+	.sync_fs	= numbfs_sync_fs,
+	.statfs		= numbfs_statfs,
+	.show_options	= numbfs_show_options,
 };
 
 static int numbfs_read_superblock(struct super_block *sb)
@@ -217,15 +331,34 @@ static int numbfs_read_superblock(struct super_block *sb)
 
 	sbi->feature		= le32_to_cpu(nsb->s_feature);
 	sbi->total_inodes	= le32_to_cpu(nsb->s_total_inodes);
-	sbi->free_inodes	= le32_to_cpu(nsb->s_free_inodes);
 	sbi->data_blocks	= le32_to_cpu(nsb->s_data_blocks);
-	sbi->free_blocks	= le32_to_cpu(nsb->s_free_blocks);
 	sbi->ibitmap_start	= le32_to_cpu(nsb->s_ibitmap_start);
 	sbi->inode_start	= le32_to_cpu(nsb->s_inode_start);
 	sbi->bbitmap_start	= le32_to_cpu(nsb->s_bbitmap_start);
 	sbi->data_start		= le32_to_cpu(nsb->s_data_start);
 	sbi->block_bits		= NUMBFS_BLOCK_BITS;
 
+	if (sbi->feature & ~NUMBFS_FEATURE_ALL) {
+		pr_err("numbfs: unsupported features 0x%x\n",
+		       sbi->feature & ~NUMBFS_FEATURE_ALL);
+		goto exit;
+	}
+
+	/* large directories need the extent map */
+	if (numbfs_has_large_ino(sbi) && !numbfs_has_extent(sbi)) {
+		pr_err("numbfs: large inode numbers need the extent feature\n");
+		goto exit;
+	}
+
+	if (!numbfs_has_large_ino(sbi) &&
+	    sbi->total_inodes > NUMBFS_MAX_INODES) {
+		pr_err("numbfs: too many inodes %d\n", sbi->total_inodes);
+		goto exit;
+	}
+
+	if (numbfs_has_extent(sbi))
+		sb->s_maxbytes = NUMBFS_EXTENT_MAXBYTES;
+
 	err = 0;
 exit:
 	numbfs_bput(&buf);
@@ -234,6 +367,7 @@ exit:
 
 static int numbfs_fc_fill_super(struct super_block *sb, struct fs_context *fc)
 {
+	struct numbfs_fs_context *ctx = fc->fs_private;
 	struct numbfs_superblock_info *sbi;
 	struct inode *inode;
 	int err;
@@ -246,24 +380,50 @@ static int numbfs_fc_fill_super(struct super_block *sb, struct fs_context *fc)
 	sb->s_xattr = numbfs_xattr_handlers;
 	// TODO: xxx
 	sb->s_export_op = NULL;
-	if (!sb_set_blocksize(sb, NUMBFS_BYTES_PER_BLOCK)) {
-		err = -EINVAL;
-		goto err_exit;
-	}
+	if (!sb_set_blocksize(sb, NUMBFS_BYTES_PER_BLOCK))
+		return -EINVAL;
 
 	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
 	if (!sbi)
 		return -ENOMEM;
 	sbi->block_bits = NUMBFS_BLOCK_BITS;
+	sbi->mount_opt = ctx->mount_opt;
 	spin_lock_init(&sbi->s_lock);
-	mutex_init(&sbi->s_mutex);
+
+	if (numbfs_test_opt(sbi, DISCARD) &&
+	    !bdev_max_discard_sectors(sb->s_bdev)) {
+		pr_warn("numbfs: device does not support discard, disabling it\n");
+		sbi->mount_opt &= ~NUMBFS_MOUNT_DISCARD;
+	}
 
 	sb->s_fs_info = sbi;
+	numbfs_frees_init(sb);
 
 	err = numbfs_read_superblock(sb);
 	if (err)
 		goto err_exit;
 
+	err = numbfs_endio_init(sb);
+	if (err)
+		goto err_exit;
+
+	err = numbfs_ncache_init(sb);
+	if (err)
+		goto err_exit;
+
+	err = numbfs_bitmap_load(sb, &sbi->ibmap, sbi->ibitmap_start,
+				 sbi->total_inodes);
+	if (err)
+		goto err_exit;
+
+	err = numbfs_bitmap_load(sb, &sbi->bbmap, sbi->bbitmap_start,
+				 sbi->data_blocks);
+	if (err)
+		goto err_exit;
+
+	err = numbfs_groups_init(sbi);
+	if (err)
+		goto err_exit;
 
 	inode = numbfs_iget(sb, NUMBFS_ROOT_NID);
 	if (IS_ERR(inode)) {
@@ -289,6 +449,11 @@ static int numbfs_fc_fill_super(struct super_block *sb, struct fs_context *fc)
 
 	return 0;
 err_exit:
+	numbfs_endio_destroy(sbi);
+	numbfs_ncache_destroy(sbi);
+	numbfs_groups_release(sbi);
+	numbfs_bitmap_release(&sbi->ibmap);
+	numbfs_bitmap_release(&sbi->bbmap);
 	sb->s_fs_info = NULL;
 	kfree(sbi);
 	return err;
@@ -299,15 +464,62 @@ static int numbfs_fc_get_tree(struct fs_context *fc)
 	return get_tree_bdev(fc, numbfs_fc_fill_super);
 }
 
+static int numbfs_fc_parse_param(struct fs_context *fc,
+				 struct fs_parameter *param)
+{
+	struct numbfs_fs_context *ctx = fc->fs_private;
+	struct fs_parse_result result;
+	int opt;
+
+	opt = fs_parse(fc, numbfs_fs_parameters, param, &result);
+	if (opt < 0)
+		return opt;
+
+	switch (opt) {
+	case Opt_delalloc:
+		if (result.negated)
+			ctx->mount_opt &= ~NUMBFS_MOUNT_DELALLOC;
+		else
+			ctx->mount_opt |= NUMBFS_MOUNT_DELALLOC;
+		break;
+	case Opt_discard:
+		if (result.negated)
+			ctx->mount_opt &= ~NUMBFS_MOUNT_DISCARD;
+		else
+			ctx->mount_opt |= NUMBFS_MOUNT_DISCARD;
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void numbfs_fc_free(struct fs_context *fc)
+{
+	kfree(fc->fs_private);
+}
+
 static const struct fs_context_operations numbfs_context_ops = {
+	.parse_param    = numbfs_fc_parse_param,
 	.get_tree       = numbfs_fc_get_tree,
+	.free           = numbfs_fc_free,
 };
 
 static int numbfs_init_fs_context(struct fs_context *fc)
 {
+	struct numbfs_fs_context *ctx;
+
 	if (fc->sb_flags & SB_KERNMOUNT)
 		return -EINVAL;
 
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	/* default mount options */
+	ctx->mount_opt = NUMBFS_MOUNT_DELALLOC;
+
+	fc->fs_private = ctx;
 	fc->ops = &numbfs_context_ops;
 	return 0;
 }
@@ -317,6 +529,11 @@ static void numbfs_kill_sb(struct super_block *sb)
 	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
 
 	kill_block_super(sb);
+	if (sbi) {
+		numbfs_groups_release(sbi);
+		numbfs_bitmap_release(&sbi->ibmap);
+		numbfs_bitmap_release(&sbi->bbmap);
+	}
 	kfree(sbi);
 	sb->s_fs_info = NULL;
 }
@@ -325,6 +542,7 @@ struct file_system_type numbfs_fs_type = {
 	.owner			= THIS_MODULE,
 	.name			= "numbfs",
 	.init_fs_context	= numbfs_init_fs_context,
+	.parameters		= numbfs_fs_parameters,
 	.kill_sb		= numbfs_kill_sb,
 	.fs_flags		= FS_REQUIRES_DEV | FS_ALLOW_IDMAP,
 };
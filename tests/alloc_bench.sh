@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Scaling benchmark: parallel create+write from 1 to N threads
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+FILES=${4:-50}
+
+echo "Benchmarking parallel create/write"
+
+BENCH_DIR="$MOUNT_POINT/alloc_bench"
+NPROC=$(nproc)
+[ $NPROC -gt 8 ] && NPROC=8
+
+THREADS="1"
+n=2
+while [ $n -le $NPROC ]; do
+    THREADS="$THREADS $n"
+    n=$((n * 2))
+done
+
+for t in $THREADS; do
+    sudo mkdir -p "$BENCH_DIR"
+    if ! sudo python3 - "$BENCH_DIR" $t $FILES <<'PYEOF' 2> /tmp/alloc_bench_error.log
+import os, sys, time
+from multiprocessing import Process
+
+base, threads, files = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+data = os.urandom(2048)
+
+def worker(i):
+    d = os.path.join(base, "t%d" % i)
+    os.mkdir(d)
+    for j in range(files):
+        fd = os.open(os.path.join(d, "f%d" % j), os.O_WRONLY | os.O_CREAT, 0o644)
+        os.write(fd, data)
+        os.close(fd)
+
+start = time.perf_counter()
+procs = [Process(target=worker, args=(i,)) for i in range(threads)]
+for p in procs:
+    p.start()
+for p in procs:
+    p.join()
+    if p.exitcode:
+        sys.exit("worker failed")
+os.sync()
+elapsed = time.perf_counter() - start
+
+for i in range(threads):
+    if len(os.listdir(os.path.join(base, "t%d" % i))) != files:
+        sys.exit("missing files in t%d" % i)
+print("%2d threads: %8.1f files/s" % (threads, threads * files / elapsed))
+PYEOF
+    then
+        echo "FAIL: parallel create/write with $t threads failed"
+        cat /tmp/alloc_bench_error.log
+        sudo dmesg | tail -200
+        exit 1
+    fi
+    sudo rm -rf "$BENCH_DIR"
+done
+
+echo "All tests passed for parallel create/write benchmark"
@@ -0,0 +1,78 @@
+#!/bin/bash
+#
+# Test for adding entries to a directory that can't grow
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing full directories"
+
+TEST_DIR="$MOUNT_POINT/test_dir_full"
+FILL_FILE="$MOUNT_POINT/test_file_fill"
+IMAGE="$NUMBFS_ROOT/$IMAGE_NAME"
+
+fail() {
+    echo "FAIL: $1"
+    [ -f /tmp/dir_full_error.log ] && cat /tmp/dir_full_error.log
+    sudo dmesg | tail -200
+    exit 1
+}
+
+# a directory without extents holds 80 fixed-size dirents, one with
+# extents grows until the filesystem is full
+FEATURES=$(od -An -tu4 -j516 -N4 "$IMAGE")
+if [ $((FEATURES & 1)) -eq 0 ] && [ $(stat -f -c %d $MOUNT_POINT) -lt 100 ]; then
+    echo "SKIP: not enough free inodes to fill a directory"
+    exit 0
+fi
+
+sudo mkdir "$TEST_DIR"
+if [ $((FEATURES & 1)) -ne 0 ]; then
+    echo "Filling the filesystem"
+    sudo dd if=/dev/zero of="$FILL_FILE" bs=65536 2> /dev/null || true
+    sync
+fi
+
+echo "Test 1: Creating files until the directory can't grow"
+NR=0
+while [ $NR -lt 1000 ]; do
+    if ! sudo touch "$TEST_DIR/file_$NR" 2> /tmp/dir_full_error.log; then
+        grep -q "No space left on device" /tmp/dir_full_error.log ||
+            fail "Unexpected error for file_$NR"
+        break
+    fi
+    NR=$((NR + 1))
+done
+[ $NR -lt 1000 ] || fail "The directory never filled up"
+[ ! -e "$TEST_DIR/file_$NR" ] || fail "file_$NR exists after its create failed"
+echo "SUCCESS: Creating file_$NR failed with ENOSPC"
+
+echo "Test 2: Creating directories and links fails as well"
+sudo mkdir "$TEST_DIR/dir" 2> /tmp/dir_full_error.log && fail "mkdir succeeded"
+sudo ln "$TEST_DIR/file_0" "$TEST_DIR/link" 2> /tmp/dir_full_error.log && fail "link succeeded"
+sudo ln -s file_0 "$TEST_DIR/symlink" 2> /tmp/dir_full_error.log && fail "symlink succeeded"
+echo "SUCCESS: mkdir, link and symlink failed"
+
+echo "Test 3: Remounting filesystem and checking the entries"
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$IMAGE" $MOUNT_POINT
+[ "$(sudo ls "$TEST_DIR" | wc -l)" -eq $NR ] || fail "$(sudo ls "$TEST_DIR" | wc -l) entries after remount, expected $NR"
+for i in $(seq 0 $((NR - 1))); do
+    [ -f "$TEST_DIR/file_$i" ] || fail "file_$i is missing after remount"
+done
+echo "SUCCESS: All $NR entries are there"
+
+echo "Test 4: Removing an entry makes room for another"
+sudo rm -f "$TEST_DIR/file_0"
+sudo touch "$TEST_DIR/file_$NR" 2> /tmp/dir_full_error.log || fail "Failed to create file_$NR"
+echo "SUCCESS: file_$NR created"
+
+sudo rm -rf "$TEST_DIR" "$FILL_FILE"
+sync
+rm -f /tmp/dir_full_error.log
+
+echo "All tests passed for full directories"
@@ -0,0 +1,84 @@
+#!/bin/bash
+#
+# Test for name lookups in large directories
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing large directory functionality"
+
+TEST_DIR="$MOUNT_POINT/test_dir_index"
+# leave some inodes for the other tests
+NR=$(( $(stat -f -c %d $MOUNT_POINT) - 64 ))
+[ $NR -gt 2000 ] && NR=2000
+
+check_names() {
+    local i
+    for i in $(seq 0 $(($1 - 1))); do
+        if [ "$2" = "odd_removed" ] && [ $((i % 2)) -eq 1 ]; then
+            [ ! -e "$TEST_DIR/file_$i" ] || { echo "file_$i still exists"; return 1; }
+        else
+            [ -f "$TEST_DIR/file_$i" ] || { echo "file_$i is missing"; return 1; }
+        fi
+    done
+    [ ! -e "$TEST_DIR/no_such_file" ] || { echo "no_such_file exists"; return 1; }
+}
+
+echo "Test 1: Creating up to $NR files in one directory"
+sudo mkdir "$TEST_DIR"
+CREATED=$(sudo bash -c 'for i in $(seq 0 '$((NR - 1))'); do touch "'$TEST_DIR'/file_$i" 2> /dev/null || break; echo; done | wc -l')
+if [ $CREATED -lt 16 ]; then
+    echo "FAIL: only $CREATED files could be created"
+    sudo dmesg | tail -200
+    exit 1
+fi
+if ! check_names $CREATED all; then
+    echo "FAIL: lookup after create"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: created and found $CREATED files"
+
+echo "Test 2: Creating an existing name fails"
+if sudo mkdir "$TEST_DIR/file_$((CREATED - 1))" 2> /dev/null; then
+    echo "FAIL: mkdir over an existing file succeeded"
+    exit 1
+fi
+echo "SUCCESS: existing name detected"
+
+echo "Test 3: Unlinking every other file"
+sudo bash -c 'for i in $(seq 1 2 '$((CREATED - 1))'); do rm "'$TEST_DIR'/file_$i"; done'
+if ! check_names $CREATED odd_removed; then
+    echo "FAIL: lookup after unlink"
+    sudo dmesg | tail -200
+    exit 1
+fi
+if [ $(ls "$TEST_DIR" | wc -l) -ne $(( (CREATED + 1) / 2 )) ]; then
+    echo "FAIL: readdir returned $(ls "$TEST_DIR" | wc -l) entries"
+    exit 1
+fi
+echo "SUCCESS: remaining files found"
+
+echo "Test 4: Remounting filesystem keeps the directory"
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$NUMBFS_ROOT/$IMAGE_NAME" $MOUNT_POINT
+if ! check_names $CREATED odd_removed; then
+    echo "FAIL: lookup after remount"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: files found after remount"
+
+echo "Test 5: Removing the directory"
+sudo rm -rf "$TEST_DIR"
+if [ -e "$TEST_DIR" ]; then
+    echo "FAIL: directory still exists"
+    exit 1
+fi
+echo "SUCCESS: directory removed"
+
+echo "All tests passed for large directory functionality"
@@ -0,0 +1,60 @@
+#!/bin/bash
+#
+# Test for direct I/O
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing direct I/O functionality"
+
+TEST_FILE="$MOUNT_POINT/test_file_dio"
+SRC_FILE=/tmp/numbfs_dio_src
+OUT_FILE=/tmp/numbfs_dio_out
+
+head -c 4096 /dev/urandom > $SRC_FILE
+
+echo "Test 1: Writing 4096 bytes with O_DIRECT"
+if ! sudo dd if=$SRC_FILE of="$TEST_FILE" bs=4096 count=1 oflag=direct 2> /tmp/dio_write_error.log; then
+    echo "FAIL: Failed to write test file with O_DIRECT"
+    cat /tmp/dio_write_error.log
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: 4096 bytes written with O_DIRECT"
+
+echo "Test 2: Reading the file back with O_DIRECT"
+if ! sudo dd if="$TEST_FILE" of=$OUT_FILE bs=4096 count=1 iflag=direct 2> /tmp/dio_read_error.log; then
+    echo "FAIL: Failed to read test file with O_DIRECT"
+    cat /tmp/dio_read_error.log
+    sudo dmesg | tail -200
+    exit 1
+fi
+if ! cmp -s $SRC_FILE $OUT_FILE; then
+    echo "FAIL: O_DIRECT read does not match the written data"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: O_DIRECT read matches the written data"
+
+echo "Test 3: Remounting filesystem and reading with buffered I/O"
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$NUMBFS_ROOT/$IMAGE_NAME" $MOUNT_POINT
+if ! sudo cmp -s $SRC_FILE "$TEST_FILE"; then
+    echo "FAIL: File content does not match after remount"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: File content matches after remount"
+
+echo "Test 4: Cleaning up test file"
+if ! sudo unlink "$TEST_FILE" 2> /tmp/cleanup_error.log; then
+    echo "WARNING: Failed to clean up test file"
+    cat /tmp/cleanup_error.log
+fi
+rm -f $SRC_FILE $OUT_FILE
+
+echo "All tests passed for direct I/O functionality"
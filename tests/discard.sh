@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Test for FITRIM and the discard mount option
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing discard functionality"
+
+TEST_FILE="$MOUNT_POINT/test_file_discard"
+IMAGE="$NUMBFS_ROOT/$IMAGE_NAME"
+
+image_usage() {
+    du -k "$IMAGE" | cut -f1
+}
+
+# the test files are 4 MiB, files are limited to 5 KiB without extents
+FEATURES=$(od -An -tu4 -j516 -N4 "$IMAGE")
+if [ $((FEATURES & 1)) -eq 0 ]; then
+    echo "SKIP: discard tests need an image with the extent feature"
+    exit 0
+fi
+
+echo "Test 1: fstrim releases the freed blocks of the image"
+sudo dd if=/dev/urandom of="$TEST_FILE" bs=1M count=4 2> /dev/null
+sync
+sudo rm -f "$TEST_FILE"
+sync
+BEFORE=$(image_usage)
+if ! sudo fstrim -v $MOUNT_POINT > /tmp/discard_fstrim.log 2>&1; then
+    if grep -q "not supported" /tmp/discard_fstrim.log; then
+        echo "SKIP: discard is not supported by the device"
+        rm -f /tmp/discard_fstrim.log
+        exit 0
+    fi
+    echo "FAIL: fstrim failed"
+    cat /tmp/discard_fstrim.log
+    sudo dmesg | tail -200
+    exit 1
+fi
+cat /tmp/discard_fstrim.log
+AFTER=$(image_usage)
+if [ $AFTER -gt $((BEFORE - 2048)) ]; then
+    echo "FAIL: image usage went from ${BEFORE}K to ${AFTER}K"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: fstrim released ${BEFORE}K -> ${AFTER}K"
+
+echo "Test 2: Mounting with -o discard"
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop,discard "$IMAGE" $MOUNT_POINT
+if ! grep " $MOUNT_POINT " /proc/mounts | grep -q discard; then
+    echo "FAIL: discard is not shown in the mount options"
+    grep " $MOUNT_POINT " /proc/mounts
+    exit 1
+fi
+echo "SUCCESS: discard mount option is set"
+
+echo "Test 3: Freed blocks are discarded without fstrim"
+sudo dd if=/dev/urandom of="$TEST_FILE" bs=1M count=4 2> /dev/null
+sync
+BEFORE=$(image_usage)
+sudo rm -f "$TEST_FILE"
+sync
+AFTER=$(image_usage)
+if [ $AFTER -gt $((BEFORE - 2048)) ]; then
+    echo "FAIL: image usage went from ${BEFORE}K to ${AFTER}K"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: unlink released ${BEFORE}K -> ${AFTER}K"
+
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$IMAGE" $MOUNT_POINT
+rm -f /tmp/discard_fstrim.log
+
+echo "All tests passed for discard functionality"
@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Test for extent-mapped files that need more than the inline extents
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing extent-mapped files"
+
+TEST_FILE="$MOUNT_POINT/test_file_extent"
+REF_FILE=/tmp/numbfs_extent_ref
+IMAGE="$NUMBFS_ROOT/$IMAGE_NAME"
+
+fail() {
+    echo "FAIL: $1"
+    [ -f /tmp/extent_error.log ] && cat /tmp/extent_error.log
+    sudo dmesg | tail -200
+    exit 1
+}
+
+FEATURES=$(od -An -tu4 -j516 -N4 "$IMAGE")
+if [ $((FEATURES & 1)) -eq 0 ]; then
+    echo "SKIP: extent tests need an image with the extent feature"
+    exit 0
+fi
+
+echo "Test 1: Writing a 1MB file"
+sync
+BFREE=$(stat -f -c %f $MOUNT_POINT)
+head -c 1048576 /dev/urandom > $REF_FILE
+sudo dd if=$REF_FILE of="$TEST_FILE" bs=65536 conv=fsync 2> /tmp/extent_error.log || fail "Failed to write"
+sudo cmp -s "$TEST_FILE" $REF_FILE || fail "Data doesn't match"
+echo "SUCCESS: Data matches"
+
+echo "Test 2: Punching every other block of the first 256KB"
+# leaves 256 extents, more than one extent block holds
+for i in $(seq 1 2 511); do
+    sudo fallocate -p -o $((i * 512)) -l 512 "$TEST_FILE" 2> /tmp/extent_error.log || fail "Failed to punch block $i"
+    dd if=/dev/zero of=$REF_FILE bs=512 seek=$i count=1 conv=notrunc 2> /dev/null
+done
+sync
+sudo cmp -s "$TEST_FILE" $REF_FILE || fail "Data doesn't match after punching"
+echo "SUCCESS: Data matches"
+
+echo "Test 3: Remounting filesystem and checking the data"
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$IMAGE" $MOUNT_POINT
+sudo cmp -s "$TEST_FILE" $REF_FILE || fail "Data doesn't match after remount"
+echo "SUCCESS: Data matches"
+
+echo "Test 4: Filling the holes back in"
+sudo dd if=$REF_FILE of="$TEST_FILE" bs=65536 count=4 conv=notrunc,fsync 2> /tmp/extent_error.log || fail "Failed to rewrite"
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$IMAGE" $MOUNT_POINT
+sudo cmp -s "$TEST_FILE" $REF_FILE || fail "Data doesn't match after filling the holes"
+echo "SUCCESS: Data matches"
+
+echo "Test 5: Removing the file gives all blocks back"
+sudo rm -f "$TEST_FILE"
+sync
+# the parent directory may keep a block it grew for the entry
+[ $(stat -f -c %f $MOUNT_POINT) -ge $((BFREE - 1)) ] || fail "$BFREE free blocks before, $(stat -f -c %f $MOUNT_POINT) after"
+echo "SUCCESS: All blocks freed"
+
+rm -f $REF_FILE /tmp/extent_error.log
+
+echo "All tests passed for extent-mapped files"
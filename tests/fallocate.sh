@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# Test for fallocate: preallocation, punch-hole and zero-range
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing fallocate functionality"
+
+TEST_FILE="$MOUNT_POINT/test_file_falloc"
+REF_FILE=/tmp/numbfs_falloc_ref
+
+fail() {
+    echo "FAIL: $1"
+    [ -f /tmp/falloc_error.log ] && cat /tmp/falloc_error.log
+    sudo dmesg | tail -200
+    exit 1
+}
+
+echo "Test 1: Preallocating 64KB"
+sync
+BFREE=$(stat -f -c %f $MOUNT_POINT)
+if ! sudo fallocate -l 65536 "$TEST_FILE" 2> /tmp/falloc_error.log; then
+    if grep -q "not supported" /tmp/falloc_error.log; then
+        echo "SKIP: fallocate needs an image with the extent feature"
+        sudo rm -f "$TEST_FILE"
+        exit 0
+    fi
+    fail "Failed to preallocate"
+fi
+sync
+[ "$(stat -c %s "$TEST_FILE")" -eq 65536 ] || fail "Wrong size after preallocation"
+[ $(stat -f -c %f $MOUNT_POINT) -le $((BFREE - 128)) ] || fail "No blocks were preallocated"
+head -c 65536 /dev/zero > $REF_FILE
+sudo cmp -s "$TEST_FILE" $REF_FILE || fail "Preallocated blocks don't read as zeroes"
+echo "SUCCESS: 64KB preallocated and read as zeroes"
+
+echo "Test 2: Writing into the preallocated blocks"
+head -c 65536 /dev/urandom > $REF_FILE
+sudo dd if=$REF_FILE of="$TEST_FILE" bs=4096 conv=notrunc,fsync 2> /tmp/falloc_error.log || fail "Failed to write"
+sync
+sudo cmp -s "$TEST_FILE" $REF_FILE || fail "Data written into preallocated blocks doesn't match"
+echo "SUCCESS: Data matches"
+
+echo "Test 3: Preallocating beyond EOF with KEEP_SIZE"
+sudo fallocate -n -o 65536 -l 32768 "$TEST_FILE" 2> /tmp/falloc_error.log || fail "Failed to preallocate with KEEP_SIZE"
+[ "$(stat -c %s "$TEST_FILE")" -eq 65536 ] || fail "KEEP_SIZE changed the size"
+echo "SUCCESS: Size kept"
+
+echo "Test 4: Punching a hole"
+sync
+BUSED=$(stat -f -c %f $MOUNT_POINT)
+sudo fallocate -p -o 4000 -l 10000 "$TEST_FILE" 2> /tmp/falloc_error.log || fail "Failed to punch a hole"
+dd if=/dev/zero of=$REF_FILE bs=1 seek=4000 count=10000 conv=notrunc 2> /dev/null
+sync
+sudo cmp -s "$TEST_FILE" $REF_FILE || fail "Punched range doesn't read as zeroes"
+[ $(stat -f -c %f $MOUNT_POINT) -ge $((BUSED + 18)) ] || fail "Punching freed no blocks"
+echo "SUCCESS: Hole punched"
+
+echo "Test 5: Zeroing a range"
+sudo fallocate -z -o 30000 -l 5000 "$TEST_FILE" 2> /tmp/falloc_error.log || fail "Failed to zero a range"
+dd if=/dev/zero of=$REF_FILE bs=1 seek=30000 count=5000 conv=notrunc 2> /dev/null
+sudo cmp -s "$TEST_FILE" $REF_FILE || fail "Zeroed range doesn't read as zeroes"
+echo "SUCCESS: Range zeroed"
+
+echo "Test 6: Remounting filesystem and checking the contents"
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$NUMBFS_ROOT/$IMAGE_NAME" $MOUNT_POINT
+sudo cmp -s "$TEST_FILE" $REF_FILE || fail "Content doesn't match after remount"
+echo "SUCCESS: Content matches after remount"
+
+echo "Test 7: Cleaning up test file"
+if ! sudo unlink "$TEST_FILE" 2> /tmp/cleanup_error.log; then
+    echo "WARNING: Failed to clean up test file"
+    cat /tmp/cleanup_error.log
+fi
+rm -f $REF_FILE /tmp/falloc_error.log
+
+echo "All tests passed for fallocate functionality"
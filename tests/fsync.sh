@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Test for fsync of files and directories
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing fsync functionality"
+
+TEST_DIR="$MOUNT_POINT/test_fsync"
+
+echo "Test 1: Creating a tree and syncing files and directories"
+sudo mkdir -p "$TEST_DIR/sub"
+for i in $(seq 1 20); do
+    echo "content $i" | sudo tee "$TEST_DIR/sub/file_$i" > /dev/null
+done
+sudo ln -s sub/file_1 "$TEST_DIR/link"
+if ! sudo sync "$TEST_DIR/sub/file_1" "$TEST_DIR/sub" "$TEST_DIR"; then
+    echo "FAIL: fsync failed"
+    sudo dmesg | tail -200
+    exit 1
+fi
+if ! sudo sync -d "$TEST_DIR/sub/file_2"; then
+    echo "FAIL: fdatasync failed"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: fsync and fdatasync succeeded"
+
+echo "Test 2: Remounting filesystem keeps the tree"
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$NUMBFS_ROOT/$IMAGE_NAME" $MOUNT_POINT
+for i in $(seq 1 20); do
+    if [ "$(cat "$TEST_DIR/sub/file_$i")" != "content $i" ]; then
+        echo "FAIL: file_$i has wrong content"
+        sudo dmesg | tail -200
+        exit 1
+    fi
+done
+if [ "$(cat "$TEST_DIR/link")" != "content 1" ]; then
+    echo "FAIL: symlink is broken"
+    exit 1
+fi
+echo "SUCCESS: tree found after remount"
+
+sudo rm -rf "$TEST_DIR"
+
+echo "All tests passed for fsync functionality"
@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Test for mmap
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing mmap functionality"
+
+TEST_FILE="$MOUNT_POINT/test_file_mmap"
+SRC_FILE=/tmp/numbfs_mmap_src
+
+head -c 4096 /dev/urandom > $SRC_FILE
+
+echo "Test 1: Writing 4096 bytes through a shared mapping"
+if ! sudo python3 - "$TEST_FILE" $SRC_FILE <<'PYEOF' 2> /tmp/mmap_write_error.log
+import mmap, sys
+data = open(sys.argv[2], "rb").read()
+with open(sys.argv[1], "w+b") as f:
+    f.truncate(len(data))
+    m = mmap.mmap(f.fileno(), len(data))
+    m[:] = data
+    m.flush()
+    m.close()
+PYEOF
+then
+    echo "FAIL: Failed to write test file through mmap"
+    cat /tmp/mmap_write_error.log
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: 4096 bytes written through mmap"
+
+echo "Test 2: Remounting filesystem"
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$NUMBFS_ROOT/$IMAGE_NAME" $MOUNT_POINT
+echo "SUCCESS: Filesystem remounted"
+
+echo "Test 3: Reading the file back through a mapping"
+if ! sudo python3 - "$TEST_FILE" $SRC_FILE <<'PYEOF' 2> /tmp/mmap_read_error.log
+import mmap, sys
+data = open(sys.argv[2], "rb").read()
+with open(sys.argv[1], "rb") as f:
+    m = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+    if m[:] != data:
+        sys.exit("mapped content does not match")
+    m.close()
+PYEOF
+then
+    echo "FAIL: File content does not match through mmap"
+    cat /tmp/mmap_read_error.log
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: File content matches through mmap"
+
+echo "Test 4: Cleaning up test file"
+if ! sudo unlink "$TEST_FILE" 2> /tmp/cleanup_error.log; then
+    echo "WARNING: Failed to clean up test file"
+    cat /tmp/cleanup_error.log
+fi
+rm -f $SRC_FILE
+
+echo "All tests passed for mmap functionality"
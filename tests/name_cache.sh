@@ -0,0 +1,68 @@
+#!/bin/bash
+#
+# Test for directory name lookups across renames, unlinks and reclaim
+#
+
+set -e
+
+MOUNT_POINT=$1
+
+echo "Testing name cache functionality"
+
+TEST_DIR="$MOUNT_POINT/test_name_cache"
+# a directory without extents holds 80 fixed-size dirents, and leave
+# some inodes for the other tests
+NR=$(( $(stat -f -c %d $MOUNT_POINT) - 64 ))
+[ $NR -gt 70 ] && NR=70
+
+fail() {
+    echo "FAIL: $1"
+    sudo dmesg | tail -200
+    exit 1
+}
+
+echo "Test 1: Creating files and looking them up"
+sudo mkdir "$TEST_DIR"
+sudo bash -c 'for i in $(seq 1 '$NR'); do touch "'$TEST_DIR'/file_$i"; done'
+for i in $(seq 1 $NR); do
+    [ -f "$TEST_DIR/file_$i" ] || fail "file_$i is missing"
+done
+[ ! -e "$TEST_DIR/file_0" ] || fail "file_0 exists"
+echo "SUCCESS: all files found"
+
+echo "Test 2: Renaming and unlinking keep lookups consistent"
+sudo bash -c 'for i in $(seq 1 2 '$NR'); do mv "'$TEST_DIR'/file_$i" "'$TEST_DIR'/moved_$i"; done'
+sudo bash -c 'for i in $(seq 2 4 '$NR'); do rm "'$TEST_DIR'/file_$i"; done'
+for i in $(seq 1 $NR); do
+    if [ $((i % 2)) -eq 1 ]; then
+        [ -f "$TEST_DIR/moved_$i" ] || fail "moved_$i is missing"
+        [ ! -e "$TEST_DIR/file_$i" ] || fail "file_$i still exists"
+    elif [ $((i % 4)) -eq 2 ]; then
+        [ ! -e "$TEST_DIR/file_$i" ] || fail "file_$i still exists"
+    else
+        [ -f "$TEST_DIR/file_$i" ] || fail "file_$i is missing"
+    fi
+done
+echo "SUCCESS: lookups follow renames and unlinks"
+
+echo "Test 3: Lookups after dropping caches"
+sync
+echo 3 | sudo tee /proc/sys/vm/drop_caches > /dev/null
+if sudo touch "$TEST_DIR/moved_1" && sudo mkdir "$TEST_DIR/moved_1" 2> /dev/null; then
+    fail "mkdir over an existing file succeeded"
+fi
+for i in $(seq 1 $NR); do
+    if [ $((i % 4)) -eq 2 ]; then
+        [ ! -e "$TEST_DIR/file_$i" ] || fail "file_$i still exists"
+    elif [ $((i % 2)) -eq 1 ]; then
+        [ -f "$TEST_DIR/moved_$i" ] || fail "moved_$i is missing"
+    fi
+done
+if [ $(ls "$TEST_DIR" | wc -l) -ne $((NR - (NR + 2) / 4)) ]; then
+    fail "readdir returned $(ls "$TEST_DIR" | wc -l) entries"
+fi
+echo "SUCCESS: lookups consistent after reclaim"
+
+sudo rm -rf "$TEST_DIR"
+
+echo "All tests passed for name cache functionality"
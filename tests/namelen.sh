@@ -0,0 +1,42 @@
+#!/bin/bash
+#
+# Test for the maximum name length reported by statfs
+#
+
+set -e
+
+MOUNT_POINT=$1
+
+echo "Testing name length functionality"
+
+NAMELEN=$(stat -f -c %l $MOUNT_POINT)
+LONGEST=$(printf 'n%.0s' $(seq 1 $NAMELEN))
+
+echo "Test 1: Creating a file with a $NAMELEN-byte name"
+if ! sudo touch "$MOUNT_POINT/$LONGEST"; then
+    echo "FAIL: could not create a file with the longest name"
+    sudo dmesg | tail -200
+    exit 1
+fi
+if [ "$(ls $MOUNT_POINT | grep -c "^$LONGEST\$")" -ne 1 ]; then
+    echo "FAIL: the longest name is not listed"
+    exit 1
+fi
+echo "SUCCESS: longest name created"
+
+echo "Test 2: Creating a file with a longer name fails"
+if sudo touch "$MOUNT_POINT/${LONGEST}x" 2> /tmp/namelen.log; then
+    echo "FAIL: a name longer than $NAMELEN bytes was accepted"
+    exit 1
+fi
+if ! grep -q "File name too long" /tmp/namelen.log; then
+    echo "FAIL: unexpected error"
+    cat /tmp/namelen.log
+    exit 1
+fi
+echo "SUCCESS: longer name rejected"
+
+sudo rm -f "$MOUNT_POINT/$LONGEST"
+rm -f /tmp/namelen.log
+
+echo "All tests passed for name length functionality"
@@ -0,0 +1,77 @@
+#!/bin/bash
+#
+# Test for SEEK_HOLE/SEEK_DATA and FIEMAP
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing SEEK_HOLE/SEEK_DATA and FIEMAP"
+
+TEST_FILE="$MOUNT_POINT/test_file_sparse"
+
+fail() {
+    echo "FAIL: $1"
+    [ -f /tmp/seek_error.log ] && cat /tmp/seek_error.log
+    sudo dmesg | tail -200
+    exit 1
+}
+
+echo "Test 1: Creating a sparse file"
+# data in [0, 512) and [4096, 4608), a hole in between
+sudo dd if=/dev/urandom of="$TEST_FILE" bs=512 count=1 2> /dev/null || fail "Failed to write"
+sudo dd if=/dev/urandom of="$TEST_FILE" bs=512 seek=8 count=1 conv=notrunc 2> /dev/null || fail "Failed to write"
+echo "SUCCESS: Sparse file created"
+
+check_seek() {
+    if ! sudo python3 - "$TEST_FILE" <<'PYEOF' 2> /tmp/seek_error.log
+import os, sys
+
+fd = os.open(sys.argv[1], os.O_RDONLY)
+checks = [(0, os.SEEK_DATA, 0), (0, os.SEEK_HOLE, 512),
+          (512, os.SEEK_DATA, 4096), (1000, os.SEEK_HOLE, 1000),
+          (4096, os.SEEK_HOLE, 4608)]
+for off, whence, want in checks:
+    got = os.lseek(fd, off, whence)
+    if got != want:
+        sys.exit("lseek(%d, %d) returned %d, expected %d" % (off, whence, got, want))
+try:
+    os.lseek(fd, 4608, os.SEEK_DATA)
+    sys.exit("SEEK_DATA found data beyond EOF")
+except OSError:
+    pass
+PYEOF
+    then
+        fail "$1"
+    fi
+}
+
+echo "Test 2: Seeking holes and data in the page cache"
+check_seek "Wrong hole/data offsets before writeback"
+echo "SUCCESS: Offsets match"
+
+echo "Test 3: Seeking holes and data on disk"
+sync
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$NUMBFS_ROOT/$IMAGE_NAME" $MOUNT_POINT
+check_seek "Wrong hole/data offsets after remount"
+echo "SUCCESS: Offsets match after remount"
+
+echo "Test 4: Reporting the block map with FIEMAP"
+if ! sudo filefrag -v "$TEST_FILE" > /tmp/seek_error.log 2>&1; then
+    fail "filefrag failed"
+fi
+grep -q "2 extents found" /tmp/seek_error.log || fail "Wrong number of extents"
+echo "SUCCESS: FIEMAP reports 2 extents"
+
+echo "Test 5: Cleaning up test file"
+if ! sudo unlink "$TEST_FILE" 2> /tmp/cleanup_error.log; then
+    echo "WARNING: Failed to clean up test file"
+    cat /tmp/cleanup_error.log
+fi
+rm -f /tmp/seek_error.log
+
+echo "All tests passed for SEEK_HOLE/SEEK_DATA and FIEMAP"
@@ -0,0 +1,92 @@
+#!/bin/bash
+#
+# Throughput benchmark: read()+write() vs sendfile() vs copy_file_range()
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+LOOPS=${4:-20000}
+
+echo "Benchmarking sendfile against read+write"
+
+TEST_FILE="$MOUNT_POINT/test_file_sendfile"
+COPY_FILE="$MOUNT_POINT/test_file_sendfile_copy"
+SRC_FILE=/tmp/numbfs_sendfile_src
+
+head -c 4096 /dev/urandom > $SRC_FILE
+sudo cp $SRC_FILE "$TEST_FILE"
+
+echo "Test 1: sendfile and copy_file_range produce the same data"
+if ! sudo python3 - "$TEST_FILE" "$COPY_FILE" $SRC_FILE <<'PYEOF' 2> /tmp/sendfile_error.log
+import os, sys
+src, dst, ref = sys.argv[1:4]
+data = open(ref, "rb").read()
+
+fin = os.open(src, os.O_RDONLY)
+fout = os.open(dst, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o644)
+off = 0
+while off < len(data):
+    off += os.sendfile(fout, fin, off, len(data) - off)
+os.close(fout)
+if open(dst, "rb").read() != data:
+    sys.exit("sendfile copy does not match")
+
+fout = os.open(dst, os.O_WRONLY | os.O_TRUNC)
+off = 0
+while off < len(data):
+    off += os.copy_file_range(fin, fout, len(data) - off, off, off)
+os.close(fout)
+os.close(fin)
+if open(dst, "rb").read() != data:
+    sys.exit("copy_file_range copy does not match")
+PYEOF
+then
+    echo "FAIL: sendfile/copy_file_range copy mismatch"
+    cat /tmp/sendfile_error.log
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: sendfile and copy_file_range copies match"
+
+echo "Test 2: Throughput of $LOOPS passes over a cached file"
+sudo python3 - "$TEST_FILE" $LOOPS <<'PYEOF'
+import os, sys, time
+path, loops = sys.argv[1], int(sys.argv[2])
+size = os.path.getsize(path)
+fin = os.open(path, os.O_RDONLY)
+fout = os.open("/dev/null", os.O_WRONLY)
+
+def bench(name, fn):
+    start = time.perf_counter()
+    for _ in range(loops):
+        fn()
+    elapsed = time.perf_counter() - start
+    print("%-12s %8.1f MiB/s" % (name, size * loops / elapsed / (1 << 20)))
+
+def read_write():
+    off = 0
+    while off < size:
+        buf = os.pread(fin, 65536, off)
+        os.write(fout, buf)
+        off += len(buf)
+
+def sendfile():
+    off = 0
+    while off < size:
+        off += os.sendfile(fout, fin, off, size - off)
+
+bench("read+write", read_write)
+bench("sendfile", sendfile)
+PYEOF
+
+echo "Test 3: Cleaning up test files"
+if ! sudo rm -f "$TEST_FILE" "$COPY_FILE" 2> /tmp/cleanup_error.log; then
+    echo "WARNING: Failed to clean up test files"
+    cat /tmp/cleanup_error.log
+fi
+rm -f $SRC_FILE
+
+echo "All tests passed for sendfile benchmark"
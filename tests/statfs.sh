@@ -0,0 +1,76 @@
+#!/bin/bash
+#
+# Test for statfs and the persistence of the free counters
+#
+
+set -e
+
+MOUNT_POINT=$1
+NUMBFS_ROOT=$2
+IMAGE_NAME=$3
+
+echo "Testing statfs functionality"
+
+TEST_FILE="$MOUNT_POINT/test_file_statfs"
+
+free_blocks() {
+    stat -f -c %f $MOUNT_POINT
+}
+
+free_inodes() {
+    stat -f -c %d $MOUNT_POINT
+}
+
+echo "Test 1: Running df on the mount point"
+if ! df $MOUNT_POINT > /tmp/statfs_df.log 2>&1 || ! df -i $MOUNT_POINT >> /tmp/statfs_df.log 2>&1; then
+    echo "FAIL: df failed"
+    cat /tmp/statfs_df.log
+    sudo dmesg | tail -200
+    exit 1
+fi
+if [ "$(stat -f -c %b $MOUNT_POINT)" -le 0 ] || [ "$(stat -f -c %c $MOUNT_POINT)" -le 0 ]; then
+    echo "FAIL: statfs reports no blocks or no inodes"
+    stat -f $MOUNT_POINT
+    exit 1
+fi
+echo "SUCCESS: df works"
+
+echo "Test 2: Writing a file uses blocks and an inode"
+sync
+BFREE=$(free_blocks)
+IFREE=$(free_inodes)
+# stay below the 10 direct blocks of an image without extents
+sudo dd if=/dev/urandom of="$TEST_FILE" bs=512 count=8 2> /dev/null
+sync
+if [ $(free_blocks) -gt $((BFREE - 8)) ] || [ $(free_inodes) -ne $((IFREE - 1)) ]; then
+    echo "FAIL: free counters $BFREE/$IFREE became $(free_blocks)/$(free_inodes)"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: free counters dropped"
+
+echo "Test 3: Remounting filesystem keeps the free counters"
+BUSED=$(free_blocks)
+IUSED=$(free_inodes)
+sudo umount $MOUNT_POINT
+sudo mount -t numbfs -o loop "$NUMBFS_ROOT/$IMAGE_NAME" $MOUNT_POINT
+if [ $(free_blocks) -ne $BUSED ] || [ $(free_inodes) -ne $IUSED ]; then
+    echo "FAIL: free counters $BUSED/$IUSED became $(free_blocks)/$(free_inodes) after remount"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: free counters match after remount"
+
+echo "Test 4: Unlinking the file frees its blocks and inode"
+sudo unlink "$TEST_FILE"
+sync
+if [ $(free_blocks) -lt $((BUSED + 8)) ] || [ $(free_inodes) -ne $IFREE ]; then
+    echo "FAIL: free counters $BUSED/$IUSED became $(free_blocks)/$(free_inodes) after unlink"
+    sudo dmesg | tail -200
+    exit 1
+fi
+echo "SUCCESS: blocks and inode freed"
+
+rm -f /tmp/statfs_df.log
+
+echo "All tests passed for statfs functionality"
@@ -0,0 +1,143 @@
+#!/bin/bash
+#
+# Turn on features of an image freshly made by mkfs.numbfs, which formats
+# images without any.  The inodes are converted to extents and the
+# directories to compact dirents when those features are turned on.
+#
+# usage: tune_image.sh IMAGE [extent] [dir_index] [large_ino] [compact_dirent]
+#
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 IMAGE [extent] [dir_index] [large_ino] [compact_dirent]"
+    exit 1
+fi
+
+python3 - "$@" <<'PYEOF'
+import struct, sys
+
+FEATURES = {"extent": 0x1, "dir_index": 0x2, "large_ino": 0x4,
+            "compact_dirent": 0x8}
+MAGIC = 0x4E554D42
+BLOCK = 512
+SUPER = 512
+HOLE = 0xFFFFFFE0
+NUM_DATA = 10
+INLINE_EXTENTS = 3
+S_IFMT, S_IFDIR = 0o170000, 0o040000
+
+def fail(msg):
+    sys.exit("tune_image: " + msg)
+
+image, names = sys.argv[1], sys.argv[2:]
+feature = 0
+for name in names:
+    if name not in FEATURES:
+        fail("unknown feature " + name)
+    feature |= FEATURES[name]
+if feature & FEATURES["large_ino"] and not feature & FEATURES["extent"]:
+    fail("large_ino needs extent")
+
+with open(image, "rb") as f:
+    img = bytearray(f.read())
+
+(magic, old, ibitmap, inode_start, bbitmap, data_start, total_inodes,
+ free_inodes, data_blocks, free_blocks) = struct.unpack_from("<10I", img, SUPER)
+if magic != MAGIC:
+    fail("no numbfs superblock")
+if old:
+    fail("the image already has features 0x%x" % old)
+
+def bit(start, nr):
+    return start * BLOCK + nr // 8, 1 << (nr % 8)
+
+def block(pblk):
+    return (data_start + pblk) * BLOCK
+
+def bfree(pblk):
+    global free_blocks
+    off, mask = bit(bbitmap, pblk)
+    img[off] &= ~mask
+    free_blocks += 1
+
+def to_compact(off, size, data):
+    """rewrite the fixed 64-byte dirents of a directory as compact ones"""
+    dents = []
+    for i in range(size // 64):
+        pblk = data[i * 64 // BLOCK]
+        if pblk == HOLE:
+            fail("directory with a hole")
+        de = block(pblk) + i * 64 % BLOCK
+        namelen, dtype = img[de], img[de + 1]
+        ino, = struct.unpack_from("<H", img, de + 62)
+        if namelen:
+            dents.append((bytes(img[de + 2:de + 2 + namelen]), dtype, ino))
+
+    blocks = [[]]
+    used = 0
+    for name, dtype, ino in dents:
+        reclen = (8 + len(name) + 3) & ~3
+        if used + reclen > BLOCK:
+            blocks.append([])
+            used = 0
+        blocks[-1].append((name, dtype, ino, reclen))
+        used += reclen
+
+    mapped = [pblk for pblk in data if pblk != HOLE]
+    if len(blocks) > len(mapped):
+        fail("directory needs more blocks as compact dirents")
+    for b, ents in enumerate(blocks):
+        base = block(data[b])
+        img[base:base + BLOCK] = bytes(BLOCK)
+        pos = 0
+        for n, (name, dtype, ino, reclen) in enumerate(ents):
+            # the last dirent of a block reaches its end
+            if n == len(ents) - 1:
+                reclen = BLOCK - pos
+            struct.pack_into("<IHBB", img, base + pos, ino, reclen,
+                             len(name), dtype)
+            img[base + pos + 8:base + pos + 8 + len(name)] = name
+            pos += reclen
+    for b in range(len(blocks), NUM_DATA):
+        if data[b] != HOLE:
+            bfree(data[b])
+            data[b] = HOLE
+    struct.pack_into("<I", img, off + 12, len(blocks) * BLOCK)
+
+def to_extents(off, data):
+    """map the direct blocks of an inode with inline extents"""
+    extents = []
+    for lblk, pblk in enumerate(data):
+        if pblk == HOLE:
+            continue
+        if extents and extents[-1][0] + extents[-1][2] == lblk and \
+           extents[-1][1] + extents[-1][2] == pblk:
+            extents[-1][2] += 1
+        else:
+            extents.append([lblk, pblk, 1])
+    if len(extents) > INLINE_EXTENTS:
+        fail("inode with more than %d extents" % INLINE_EXTENTS)
+    img[off + 24:off + 64] = bytes(40)
+    struct.pack_into("<I", img, off + 24, HOLE)
+    for i, ext in enumerate(extents):
+        struct.pack_into("<3I", img, off + 28 + i * 12, *ext)
+
+for nid in range(total_inodes):
+    boff, mask = bit(ibitmap, nid)
+    if not img[boff] & mask:
+        continue
+    off = inode_start * BLOCK + nid * 64
+    mode, size = struct.unpack_from("<II", img, off + 8)
+    data = list(struct.unpack_from("<10I", img, off + 24))
+    if feature & FEATURES["compact_dirent"] and mode & S_IFMT == S_IFDIR:
+        to_compact(off, size, data)
+        struct.pack_into("<10I", img, off + 24, *data)
+    if feature & FEATURES["extent"]:
+        to_extents(off, data)
+
+struct.pack_into("<I", img, SUPER + 4, feature)
+struct.pack_into("<I", img, SUPER + 36, free_blocks)
+with open(image, "r+b") as f:
+    f.write(img)
+PYEOF
@@ -34,6 +34,29 @@ int numbfs_ibuf_read(struct numbfs_buf *buf)
 	return 0;
 }
 
+/*
+ * Same as numbfs_ibuf_read(), but kick off readahead of up to @nr pages
+ * with @ra if the block is not cached or a readahead mark is hit.
+ */
+int numbfs_ibuf_read_ra(struct numbfs_buf *buf, struct file_ra_state *ra,
+			struct file *file, unsigned long nr)
+{
+	struct address_space *mapping = buf->inode->i_mapping;
+	pgoff_t index = (buf->blkaddr << NUMBFS_BLOCK_BITS) >> PAGE_SHIFT;
+	struct folio *folio;
+
+	folio = filemap_get_folio(mapping, index);
+	if (IS_ERR(folio)) {
+		page_cache_sync_readahead(mapping, ra, file, index, nr);
+	} else {
+		if (folio_test_readahead(folio))
+			page_cache_async_readahead(mapping, ra, file, folio,
+						   index, nr);
+		folio_put(folio);
+	}
+	return numbfs_ibuf_read(buf);
+}
+
 void numbfs_ibuf_put(struct numbfs_buf *buf)
 {
 	if (!buf->folio)
@@ -66,172 +89,317 @@ struct numbfs_inode *numbfs_idisk(struct numbfs_buf *buf,
 	return ret;
 }
 
-/**
- * numbfs_iaddrspace_blkaddr - Get or allocate a block address for a given file position
- * @ni: Pointer to the numbfs inode info structure
- * @pos: File position (byte offset) to map to a block
- * @alloc: If true, allocate a new block if the position is a hole
- *
- * Return:
- *   On success, returns the physical block number (>= 0).
- *   If @pos is out of range, returns -E2BIG.
- *   If block allocation fails (when @alloc is true), returns the error code
- *   from numbfs_balloc().
+/*
+ * number of blocks from @lblk on, at most @len, that are either all holes or
+ * mapped to physically contiguous blocks
  */
-int numbfs_iaddrspace_blkaddr(struct numbfs_inode_info *ni,
-			      unsigned long pos, bool alloc)
+static int numbfs_data_run(struct numbfs_inode_info *ni, int lblk, int len)
 {
-	int blk, err;
+	int blk = ni->data[lblk];
+	int i, end = min(NUMBFS_NUM_DATA_ENTRY - lblk, len);
 
-	if ((pos / NUMBFS_BYTES_PER_BLOCK) >= NUMBFS_NUM_DATA_ENTRY) {
-		pr_err("numbfs: pos@%ld is out of range\n", pos);
-		return -E2BIG;
+	for (i = 1; i < end; i++) {
+		if (blk == NUMBFS_HOLE ? ni->data[lblk + i] != NUMBFS_HOLE :
+					 ni->data[lblk + i] != blk + i)
+			break;
+	}
+	return max(i, 1);
+}
+
+/* map @map->m_lblk through the direct block pointers */
+static int numbfs_data_map(struct numbfs_inode_info *ni,
+			   struct numbfs_map *map, bool alloc)
+{
+	int i, blk, err;
+
+	if (map->m_lblk >= NUMBFS_NUM_DATA_ENTRY) {
+		if (alloc) {
+			pr_err("numbfs: block@%d is out of range\n", map->m_lblk);
+			return -EFBIG;
+		}
+		/* nothing is mapped beyond the direct blocks */
+		map->m_pblk = NUMBFS_HOLE;
+		return 0;
 	}
 
-	blk = ni->data[pos / NUMBFS_BYTES_PER_BLOCK];
+	blk = ni->data[map->m_lblk];
 	if (alloc && blk == NUMBFS_HOLE) {
-		err = numbfs_balloc(ni->vfs_inode.i_sb, &blk);
+		map->m_len = numbfs_data_run(ni, map->m_lblk, map->m_len);
+		err = numbfs_data_balloc(ni, map->m_lblk, &blk, &map->m_len);
 		if (err)
 			return err;
-		ni->data[pos / NUMBFS_BYTES_PER_BLOCK] = blk;
+		for (i = 0; i < map->m_len; i++)
+			ni->data[map->m_lblk + i] = blk + i;
+		map->m_flags |= NUMBFS_MAP_NEW;
+		mark_inode_dirty(&ni->vfs_inode);
+	} else {
+		map->m_len = numbfs_data_run(ni, map->m_lblk, map->m_len);
 	}
-	return blk;
+	map->m_pblk = blk;
+	return 0;
 }
 
-static int numbfs_bitmap_alloc(struct super_block *sb, int startblk,
-			       int total, int *res, int *quota)
+/*
+ * Where to look for the data block of @lblk: right after the physical block
+ * of the last mapped block before it, or right after the xattr block for
+ * the first block of a file.
+ */
+static int numbfs_data_goal(struct numbfs_inode_info *ni, int lblk)
 {
-	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
-	int err, i, byte, bit;
-	struct numbfs_buf buf;
-	unsigned char *bitmap;
-
-	err = -ENOMEM;
-	*res = -1;
-	mutex_lock(&sbi->s_mutex);
-	/* run out of quota */
-	if (!*quota)
-		goto out;
-	for (i = 0; i < total; i++) {
-		if (i % NUMBFS_BLOCKS_PER_BLOCK == 0) {
-			if (i > 0) {
-				numbfs_bput(&buf);
-			}
-
-			err = numbfs_binit(&buf, sb->s_bdev,
-					   numbfs_bmap_blk(startblk, i));
-			if (err) {
-				pr_err("numbfs: failed to init buffer\n");
-				goto out;
-			}
-
-			err = numbfs_brw(&buf, NUMBFS_READ);
-			if (err) {
-				pr_err("numbfs: failed to read bitmap block@%d\n", buf.blkaddr);
-				goto out;
-			}
-
-			bitmap = (unsigned char*)buf.base;
-		}
+	int i;
 
+	if (numbfs_has_extent(ni->sbi))
+		return numbfs_ext_goal(ni, lblk);
 
-		byte = numbfs_bmap_byte(i);
-		bit = numbfs_bmap_bit(i);
-		if (!(bitmap[byte] & (1 << bit))) {
-			*res = i;
-			bitmap[byte] |= (1 << bit);
-			err = numbfs_brw(&buf, NUMBFS_WRITE);
-			break;
-		}
+	for (i = min(lblk, NUMBFS_NUM_DATA_ENTRY) - 1; i >= 0; i--)
+		if (ni->data[i] != NUMBFS_HOLE)
+			return ni->data[i] + lblk - i;
+	return ni->xattr_start + 1;
+}
+
+/*
+ * Allocate contiguous data blocks for the hole at @lblk, at most @len of
+ * them, @len is set to the number of allocated blocks.
+ *
+ * A run of delayed allocations is allocated in one go, from the reservation.
+ * Any other hole only gets one block: nothing guarantees that the following
+ * blocks will be written, and they must not expose stale data.
+ *
+ * File data bypasses the metadata cache, so any stale cached copy of the
+ * blocks is dropped, otherwise it could be written back over the new data.
+ * Caller should hold ni->map_sem for write.
+ */
+int numbfs_data_balloc(struct numbfs_inode_info *ni, int lblk, int *blk,
+		       int *len)
+{
+	struct super_block *sb = ni->vfs_inode.i_sb;
+	bool resv = xa_load(&ni->delalloc, lblk);
+	int goal = numbfs_data_goal(ni, lblk);
+	int i, n = 1, err;
+
+	if (resv) {
+		while (n < *len && xa_load(&ni->delalloc, lblk + n))
+			n++;
+	}
 
+	err = numbfs_balloc_range(sb, S_ISREG(ni->vfs_inode.i_mode) ||
+				  S_ISDIR(ni->vfs_inode.i_mode) ? ni : NULL,
+				  goal, blk, &n, resv);
+	if (err)
+		return err;
+
+	if (resv) {
+		for (i = 0; i < n; i++)
+			xa_erase(&ni->delalloc, lblk + i);
 	}
-	if (!err)
-		*quota -= 1;;
-out:
-	mutex_unlock(&sbi->s_mutex);
-	numbfs_bput(&buf);
+	clean_bdev_aliases(sb->s_bdev, numbfs_data_blk(ni->sbi, *blk), n);
+	*len = n;
+	return 0;
+}
+
+/* trim the hole described by @map to the delalloc state of its first block */
+static void numbfs_da_map(struct numbfs_inode_info *ni,
+			  struct numbfs_map *map)
+{
+	unsigned long index = map->m_lblk;
+	int i;
+
+	if (xa_load(&ni->delalloc, map->m_lblk)) {
+		for (i = 1; i < map->m_len; i++)
+			if (!xa_load(&ni->delalloc, map->m_lblk + i))
+				break;
+		map->m_len = i;
+		map->m_flags |= NUMBFS_MAP_DELALLOC;
+		return;
+	}
+
+	if (xa_find(&ni->delalloc, &index,
+		    (unsigned long)map->m_lblk + map->m_len - 1, XA_PRESENT))
+		map->m_len = index - map->m_lblk;
+}
+
+static int __numbfs_iaddrspace_map(struct numbfs_inode_info *ni,
+				   struct numbfs_map *map, bool alloc)
+{
+	int err;
+
+	map->m_flags = 0;
+	map->m_seq = ni->map_seq;
+	if (numbfs_has_extent(ni->sbi))
+		err = numbfs_ext_map(ni, map, alloc);
+	else
+		err = numbfs_data_map(ni, map, alloc);
+
+	if (!err && map->m_pblk == NUMBFS_HOLE)
+		numbfs_da_map(ni, map);
 	return err;
 }
 
-static int numbfs_bitmap_free(struct super_block *sb, int startblk, int free,
-			      int *quota)
+/**
+ * numbfs_iaddrspace_map - Map a run of blocks of an inode
+ * @ni: Pointer to the numbfs inode info structure
+ * @map: @m_lblk and @m_len describe the wanted range
+ * @alloc: If true, allocate a new block if @m_lblk is in a hole
+ *
+ * On return @m_pblk is the data block of @m_lblk or NUMBFS_HOLE, and @m_len
+ * is trimmed to the run of blocks sharing that state.  Allocated blocks are
+ * flagged NUMBFS_MAP_NEW, holes reserved by delayed allocation are flagged
+ * NUMBFS_MAP_DELALLOC.  Allocating a delayed block consumes its reservation.
+ *
+ * Return: 0 on success, -EFBIG if @m_lblk can't be mapped, or the error
+ * code from the block allocator.
+ */
+int numbfs_iaddrspace_map(struct numbfs_inode_info *ni,
+			  struct numbfs_map *map, bool alloc)
 {
-	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
-	int err, byte, bit;
-	struct numbfs_buf buf;
-	unsigned char *bitmap;
+	int err;
 
-	mutex_lock(&sbi->s_mutex);
-	err = numbfs_binit(&buf, sb->s_bdev, numbfs_bmap_blk(startblk, free));
-	if (err)
-		goto out;
+	if (alloc)
+		down_write(&ni->map_sem);
+	else
+		down_read(&ni->map_sem);
 
-	err = numbfs_brw(&buf, NUMBFS_READ);
-	if (err)
+	err = __numbfs_iaddrspace_map(ni, map, alloc);
+
+	if (alloc)
+		up_write(&ni->map_sem);
+	else
+		up_read(&ni->map_sem);
+	return err;
+}
+
+/**
+ * numbfs_iaddrspace_reserve - Map a run of blocks for a buffered write
+ * @ni: Pointer to the numbfs inode info structure
+ * @map: @m_lblk and @m_len describe the wanted range
+ *
+ * Like numbfs_iaddrspace_map(), but a hole is reserved against the free
+ * blocks and flagged NUMBFS_MAP_DELALLOC | NUMBFS_MAP_NEW instead of being
+ * allocated.  The data blocks are picked at writeback.
+ */
+int numbfs_iaddrspace_reserve(struct numbfs_inode_info *ni,
+			      struct numbfs_map *map)
+{
+	struct super_block *sb = ni->vfs_inode.i_sb;
+	int i, err;
+
+	down_write(&ni->map_sem);
+	err = __numbfs_iaddrspace_map(ni, map, false);
+	if (err || map->m_pblk != NUMBFS_HOLE ||
+	    (map->m_flags & NUMBFS_MAP_DELALLOC))
 		goto out;
 
-	bitmap = (unsigned char*)buf.base;
-	byte = numbfs_bmap_byte(free);
-	bit = numbfs_bmap_bit(free);
-	WARN_ON(!(bitmap[byte] & (1 << bit)));
-	/* mark this folio dirty */
-	bitmap[byte] &= ~(1 << bit);
-	err = numbfs_brw(&buf, NUMBFS_WRITE);
+	/* the direct blocks can't map beyond NUMBFS_NUM_DATA_ENTRY */
+	if (!numbfs_has_extent(ni->sbi)) {
+		err = -EFBIG;
+		if (map->m_lblk >= NUMBFS_NUM_DATA_ENTRY)
+			goto out;
+		map->m_len = min(map->m_len,
+				 NUMBFS_NUM_DATA_ENTRY - map->m_lblk);
+	}
+
+	err = numbfs_breserve(sb, &map->m_len);
 	if (err)
 		goto out;
-	*quota += 1;
+
+	for (i = 0; i < map->m_len; i++) {
+		err = xa_err(xa_store(&ni->delalloc, map->m_lblk + i,
+				      xa_mk_value(1), GFP_NOFS));
+		if (err)
+			break;
+	}
+
+	if (err) {
+		numbfs_brelease(sb, map->m_len - i);
+		if (!i)
+			goto out;
+		map->m_len = i;
+		err = 0;
+	}
+	map->m_flags |= NUMBFS_MAP_DELALLOC | NUMBFS_MAP_NEW;
 out:
-	mutex_unlock(&sbi->s_mutex);
-	numbfs_bput(&buf);
+	up_write(&ni->map_sem);
 	return err;
 }
 
-int numbfs_balloc(struct super_block *sb, int *blk)
+/*
+ * drop the reservations of blocks @first to @last, caller should hold
+ * ni->map_sem
+ */
+void numbfs_da_release(struct numbfs_inode_info *ni,
+		       unsigned long first, unsigned long last)
 {
-	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
-	int res, err;
+	unsigned long index;
+	void *entry;
+	int nr = 0;
 
-	err = numbfs_bitmap_alloc(sb, sbi->bbitmap_start, sbi->data_blocks,
-				  &res, &sbi->free_blocks);
-	if (err)
-		return err;
+	xa_for_each_range(&ni->delalloc, index, entry, first, last) {
+		xa_erase(&ni->delalloc, index);
+		nr++;
+	}
 
-	*blk = res;
-	return 0;
+	if (nr)
+		numbfs_brelease(ni->vfs_inode.i_sb, nr);
 }
 
-int numbfs_bfree(struct super_block *sb, int blk)
+/* drop the reservations from @lblk on, caller should hold ni->map_sem */
+void numbfs_da_truncate(struct numbfs_inode_info *ni, int lblk)
 {
-	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
+	numbfs_da_release(ni, lblk, ULONG_MAX);
+}
 
-	if (blk >= sbi->data_blocks)
-		return -EINVAL;
+/*
+ * Allocate unwritten blocks for the holes of [@lblk, @lblk + @len).  Holes
+ * reserved by delayed allocation are left to writeback.
+ */
+int numbfs_iaddrspace_prealloc(struct numbfs_inode_info *ni, int lblk,
+			       int len)
+{
+	struct numbfs_map map;
+	int end = lblk + len, err = 0;
+
+	down_write(&ni->map_sem);
+	for (; lblk < end; lblk += map.m_len) {
+		map.m_lblk = lblk;
+		map.m_len = end - lblk;
+		err = __numbfs_iaddrspace_map(ni, &map, false);
+		if (err)
+			break;
+		if (map.m_pblk != NUMBFS_HOLE ||
+		    (map.m_flags & NUMBFS_MAP_DELALLOC))
+			continue;
 
-	return numbfs_bitmap_free(sb, sbi->bbitmap_start, blk,
-				  &sbi->free_blocks);
+		err = numbfs_ext_prealloc(ni, &map);
+		if (err)
+			break;
+	}
+	up_write(&ni->map_sem);
+	return err;
 }
 
-int numbfs_ialloc(struct super_block *sb, int *nid)
+/* free the blocks and reservations of [@lblk, @lblk + @len) */
+int numbfs_iaddrspace_punch(struct numbfs_inode_info *ni, int lblk, int len)
 {
-	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
-	int res, err;
-
-	err = numbfs_bitmap_alloc(sb, sbi->ibitmap_start, sbi->total_inodes,
-				  &res, &sbi->free_inodes);
-	if (err)
-		return err;
+	int err;
 
-	*nid = res;
-	return 0;
+	down_write(&ni->map_sem);
+	numbfs_map_changed(ni);
+	numbfs_da_release(ni, lblk, (unsigned long)lblk + len - 1);
+	err = numbfs_ext_punch(ni, lblk, len);
+	up_write(&ni->map_sem);
+	mark_inode_dirty(&ni->vfs_inode);
+	return err;
 }
 
-int numbfs_ifree(struct super_block *sb, int nid)
+/* mark the unwritten blocks of [@lblk, @lblk + @len) written */
+int numbfs_iaddrspace_convert(struct numbfs_inode_info *ni, int lblk, int len)
 {
-	struct numbfs_superblock_info *sbi = NUMBFS_SB(sb);
-
-	if (nid >= sbi->total_inodes)
-		return -EINVAL;
+	int err;
 
-	return numbfs_bitmap_free(sb, sbi->ibitmap_start, nid,
-				  &sbi->free_inodes);
+	down_write(&ni->map_sem);
+	numbfs_map_changed(ni);
+	err = numbfs_ext_convert(ni, lblk, len);
+	up_write(&ni->map_sem);
+	mark_inode_dirty(&ni->vfs_inode);
+	return err;
 }